@@ -0,0 +1,104 @@
+/*
+ * Fuzz target for the lexer, parser and word expander.
+ *
+ * Built by "make fuzz" as a libFuzzer binary, or by "make fuzz-standalone"
+ * with standalone_main.c for AFL or for replaying a corpus without clang.
+ * Both builds run under ASan/UBSan; the checks below catch logic errors
+ * the sanitizers cannot see.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parser.h"
+#include "expand.h"
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    (void)argc; (void)argv;
+    setenv("FUZZ_WORD", "value", 1);
+    setenv("FUZZ_ARRAY", "3 5  7", 1);
+    setenv("FUZZ_EMPTY", "", 1);
+    setenv("FUZZ_OPS", "a|b > c & $FUZZ_WORD", 1);
+    // Aliases that open a pipeline, and ones that refer to each other.
+    alias_set("ll", "ls -l |");
+    alias_set("loop", "loop2 x");
+    alias_set("loop2", "loop ");
+    return 0;
+}
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "fuzz_parser: invariant violated: %s\n", what);
+        abort();
+    }
+}
+
+static char *params[] = { "tsh", "one", "two words", "", NULL };
+
+static void check_command(const command_t *c) {
+    int argc = 0;
+    while (argc < MAX_ARGS && c->argv[argc]) argc++;
+    check(argc < MAX_ARGS, "argv is NULL terminated");
+    check(c->nredirs >= 0 && c->nredirs <= MAX_REDIRS, "redirection count in range");
+    check(c->nowned >= argc && c->nowned <= MAX_ARGS + MAX_REDIRS, "owned count in range");
+    for (int j = 0; j < c->nredirs; j++) {
+        const redir_t *r = &c->redirs[j];
+        check(r->fd >= 0, "redirection fd is non-negative");
+        check(r->target != NULL, "redirection has a target");
+        if (r->type == REDIR_DUP) check(r->target[0] >= '0' && r->target[0] <= '9', "dup target is an fd");
+    }
+    // Every word was allocated by expansion and is released with the command.
+    for (int j = 0; j < argc; j++) {
+        int owned = 0;
+        for (int k = 0; k < c->nowned; k++) if (c->owned[k] == c->argv[j]) owned = 1;
+        check(owned, "word is owned by the command");
+    }
+}
+
+// Walks the tree the way the executor does, expanding every stage.
+static void check_list(const list_t *l, int depth) {
+    check(l->nitems > 0 || depth > 0, "top level list is not empty");
+    check(l->refs > 0, "list is referenced");
+    expand_ctx_t ctx = { 130, 4242, 4, params, NULL };
+    for (int i = 0; i < l->nitems; i++) {
+        const pipeline_t *p = &l->items[i];
+        check(p->nstages >= 1 && p->nstages <= MAX_CMDS, "stage count in range");
+        check(p->background == 0 || p->background == 1, "background flag set");
+        check(i > 0 || p->op == LIST_SEQ, "first pipeline has no operator");
+        for (int k = 0; k < p->nstages; k++) {
+            const stage_t *st = &p->stages[k];
+            check(!st->funcname || st->group, "function has a body");
+            check(st->nwords > 0 || st->nredirs > 0 || st->group, "stage is not empty");
+            check(st->nredirs <= MAX_REDIRS, "parsed redirection count in range");
+            if (st->group) check_list(st->group, depth + 1);
+            if (st->funcname) continue;
+
+            command_t *c = malloc(sizeof(command_t));
+            if (!c) return;
+            if (expand_command(st, &ctx, c) == 0) {
+                check_command(c);
+                free_commands(c, 1);
+            }
+            free(c);
+        }
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size >= MAX_LINE) size = MAX_LINE - 1;
+    char *input = malloc(size + 1);
+    if (!input) return 0;
+    memcpy(input, data, size);
+    input[size] = '\0';
+
+    list_t *prog = NULL;
+    parse_status_t status = parse_program(input, &prog);
+    check(status == PARSE_OK || prog == NULL, "no tree unless the parse succeeded");
+    if (prog) {
+        check_list(prog, 0);
+        list_release(prog);
+    }
+
+    free(input);
+    return 0;
+}
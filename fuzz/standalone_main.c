@@ -0,0 +1,86 @@
+/*
+ * Driver for fuzz_parser.c when libFuzzer is not available.
+ *
+ *   fuzz_parser_standalone FILE...      replay corpus files / crashers
+ *   fuzz_parser_standalone < FILE       one input on stdin (AFL)
+ *   fuzz_parser_standalone -random N    N generated inputs
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned long long rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Shell-flavoured fragments, so generated lines reach deep parser states.
+static const char *fragments[] = {
+    " ", "  ", "\t", "|", "&", "<", ">", ">>", ">&", "<&", "2>", "2>&1", "1>&-", "3<",
+    "\"", "'", "\\", "\\\"", "$", "$?", "$!", "${", "}", "[", "]", "[@]", "[0]", "[99]",
+    "$FUZZ_WORD", "${FUZZ_ARRAY[1]}", "${FUZZ_ARRAY[@]}", "$FUZZ_OPS", "${FUZZ_EMPTY}",
+    "echo", "ls", "-l", "cat", "file", "9", "0", "*", "?", "x*y", "\"a b\"", "'c|d'",
+    "coproc", "wait", "%1", "\n", ";", "&&", "||", "{", "}", "(", ")", "f()", "function",
+    "$1", "$#", "$@", "\"$@\"", "${10}", "x=1", "local", "return", "ll", "loop",
+};
+
+static size_t gen(char *buf, size_t cap) {
+    size_t len = 0;
+    int parts = rng() % 64;
+    size_t nfrag = sizeof(fragments) / sizeof(fragments[0]);
+    for (int i = 0; i < parts; i++) {
+        const char *f;
+        char raw[2];
+        if (rng() % 8 == 0) {
+            raw[0] = (char)(rng() % 255 + 1);
+            raw[1] = '\0';
+            f = raw;
+        } else {
+            f = fragments[rng() % nfrag];
+        }
+        size_t n = strlen(f);
+        if (len + n >= cap) break;
+        memcpy(buf + len, f, n);
+        len += n;
+    }
+    return len;
+}
+
+static int run_file(FILE *f) {
+    static char buf[1 << 16];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    return LLVMFuzzerTestOneInput((const uint8_t *)buf, n);
+}
+
+int main(int argc, char **argv) {
+    LLVMFuzzerInitialize(&argc, &argv);
+
+    if (argc == 3 && strcmp(argv[1], "-random") == 0) {
+        long runs = atol(argv[2]);
+        char buf[4096];
+        for (long i = 0; i < runs; i++) {
+            size_t n = gen(buf, sizeof(buf));
+            LLVMFuzzerTestOneInput((const uint8_t *)buf, n);
+        }
+        printf("fuzz_parser: %ld random inputs ok\n", runs);
+        return 0;
+    }
+    if (argc == 1) return run_file(stdin);
+
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) { perror(argv[i]); return 1; }
+        run_file(f);
+        fclose(f);
+    }
+    printf("fuzz_parser: %d input(s) ok\n", argc - 1);
+    return 0;
+}
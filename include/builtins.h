@@ -3,9 +3,25 @@
 
 #include "parser.h"
 
-int is_builtin(command_t *c);
+typedef enum {
+    OPT_XTRACE,
+    OPT_PIPEFAIL,
+    OPT_COUNT
+} shell_option_t;
+
+int shell_option(shell_option_t opt);
+
+#define BUILTIN_KEEP_REDIRS 1   // its redirections stay applied to the shell (exec)
 
-int handle_builtin(command_t *c);
+typedef struct builtin {
+    const char *name;
+    int (*fn)(command_t *c);
+    int flags;
+} builtin_t;
+
+const builtin_t *find_builtin(command_t *c);
+
+int is_builtin(command_t *c);
 
 void add_history(const char *line);
 
@@ -0,0 +1,10 @@
+#ifndef COREUTILS_H
+#define COREUTILS_H
+
+int builtin_echo(char **argv);
+
+int builtin_printf(char **argv);
+
+int builtin_test(char **argv);
+
+#endif
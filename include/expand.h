@@ -0,0 +1,18 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include <sys/types.h>
+#include "parser.h"
+
+typedef struct expand_ctx {
+    int last_status;    // $?
+    pid_t last_bg_pid;  // $!, 0 if none
+    int argc;           // argv[0] is $0, the rest are $1...; argc 0 means "tsh" and none
+    char **argv;
+    const char *(*shell_var)(const char *name);    // variables kept out of the environment, or NULL
+} expand_ctx_t;
+
+int expand_command(const stage_t *st, const expand_ctx_t *ctx, command_t *c);
+int is_assignment(const char *word);
+
+#endif
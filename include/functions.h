@@ -0,0 +1,25 @@
+#ifndef FUNCTIONS_H
+#define FUNCTIONS_H
+
+#include "parser.h"
+
+// Function table, positional parameters and local variables.
+
+int function_define(const char *name, list_t *body);
+list_t *function_find(const char *name);
+int function_unset(const char *name);
+void free_functions(void);
+
+int params_push(int argc, char **argv, int is_function);
+void params_pop(void);
+void params_get(int *argc, char ***argv);
+int params_shift(int n);
+int function_depth(void);
+
+int local_declare(const char *assignment);
+
+void return_request(int status);
+int return_pending(void);
+int return_take(void);
+
+#endif
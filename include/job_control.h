@@ -2,8 +2,10 @@
 #define JOB_CONTROL_H
 
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <termios.h>
 
-#define MAX_JOBS 128
+#define MAX_JOB_PROCS 32
 
 typedef enum {
     JOB_RUNNING,
@@ -16,15 +18,43 @@ typedef struct job {
     int jid;
     char *cmdline;
     job_state_t state;
+    int stop_sig;                   // signal that last stopped the job
+    int foreground;                 // suppress async notifications while fg waits
+    pid_t pids[MAX_JOB_PROCS];      // one per pipeline stage
+    int statuses[MAX_JOB_PROCS];    // raw wait status per stage, -1 while alive
+    int nprocs;
+    int nlive;
+    struct termios tmodes;          // terminal modes saved when the job stopped
+    int has_tmodes;
+    char *trace;                    // launch half of the trace record, if tracing
+    long long start_us, spawn_us, end_us, cpu_us;
 } job_t;
 
 void init_jobs(void);
-int add_job(pid_t pgid, const char *cmdline);
+void init_job_control(void);
+int job_control_enabled(void);
+void terminal_foreground(pid_t pgid);
+void terminal_give(pid_t pgid, const job_t *j);
+void terminal_reclaim(job_t *j);
+int add_job(pid_t pgid, const pid_t *pids, int npids, const char *cmdline);
 job_t* find_job_by_jid(int jid);
 job_t* find_job_by_pgid(pid_t pgid);
+job_t* find_job_by_pid(pid_t pid, int *stage);
 void remove_job(job_t *j);
 void print_jobs(void);
+void job_update(pid_t pid, int status, const struct rusage *ru);
+int job_exit_status(const job_t *j);
+int status_to_exit(int status);
+int pipeline_status(const int *codes, int n);
+int job_continue(job_t *j, int foreground);
+int wait_for_job(job_t *j);
+int wait_for_pid(pid_t pid);
+job_t* wait_any_job(job_t *const *only, int nonly);
+int wait_interrupted(void);
+void trace_done_jobs(void);
 void sigchld_handler(int sig);
+void hangup_jobs(void);
 void free_jobs(void);
+void job_control_subshell(void);
 
 #endif
@@ -3,15 +3,85 @@
 
 #define MAX_ARGS 128
 #define MAX_CMDS 32
+#define MAX_REDIRS 16
 #define MAX_LINE 8192
 
+typedef enum {
+    REDIR_IN,       // [n]<file
+    REDIR_OUT,      // [n]>file
+    REDIR_APPEND,   // [n]>>file
+    REDIR_DUP,      // [n]<&m, [n]>&m
+    REDIR_CLOSE     // [n]<&-, [n]>&-
+} redir_type_t;
+
+typedef struct redir {
+    int fd;
+    redir_type_t type;
+    char *target;   // filename, or source fd for REDIR_DUP
+} redir_t;
+
+typedef struct list list_t;
+
+// A pipeline stage after expansion, ready to run.
 typedef struct command {
     char *argv[MAX_ARGS];
-    char *infile;
-    char *outfile;
-    int append;
+    redir_t redirs[MAX_REDIRS];
+    int nredirs;
+    list_t *group;                      // "{ ...; }" to run instead of argv
+    char *owned[MAX_ARGS + MAX_REDIRS]; // strings allocated by expansion
+    int nowned;
 } command_t;
 
-int parse_line(char *line, command_t cmds[], int *background);
+// A stage as parsed. Words keep their quotes and $-references until the
+// stage is expanded, so a stored function body can run many times.
+typedef struct stage {
+    char **words;
+    int nwords;
+    redir_t *redirs;    // targets are unexpanded words too
+    int nredirs;
+    list_t *group;      // "{ ...; }", or a function body
+    char *funcname;     // set for "name() { ...; }"
+} stage_t;
+
+typedef enum {
+    LIST_SEQ,       // after ';', '&', a newline, or first
+    LIST_AND,       // after '&&'
+    LIST_OR         // after '||'
+} list_op_t;
+
+typedef struct pipeline {
+    stage_t *stages;
+    int nstages;
+    int background;
+    list_op_t op;   // how this pipeline follows the previous one
+    char *text;     // the pipeline as written, for jobs and traces
+} pipeline_t;
+
+// Shared by the function table and by calls in progress, so redefining a
+// function while it runs is safe.
+struct list {
+    pipeline_t *items;
+    int nitems;
+    int refs;
+};
+
+typedef enum {
+    PARSE_OK,
+    PARSE_INCOMPLETE,   // open quote, brace or operator: needs another line
+    PARSE_ERROR
+} parse_status_t;
+
+parse_status_t parse_program(const char *text, list_t **out);
+
+list_t *list_retain(list_t *l);
+void list_release(list_t *l);
+
+void free_commands(command_t cmds[], int ncmds);
+
+int alias_set(const char *name, const char *value);
+const char *alias_get(const char *name);
+int alias_unset(const char *name);
+void alias_clear(void);
+void alias_print(void);
 
 #endif
@@ -0,0 +1,17 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+typedef enum {
+    PROF_SIGNALS,
+    PROF_JOBS,
+    PROF_PROMPT,
+    PROF_TERMINAL,
+    PROF_NPHASES
+} profile_phase_t;
+
+void profile_enable(void);
+void profile_begin(profile_phase_t phase);
+void profile_end(profile_phase_t phase);
+void profile_report(void);
+
+#endif
@@ -2,5 +2,6 @@
 #define READLINE_H
 
 char *tsh_readline(const char *prompt);
+int tsh_readline_interrupted(void);
 
 #endif
@@ -0,0 +1,12 @@
+#ifndef RESOURCES_H
+#define RESOURCES_H
+
+int builtin_ulimit(char **argv);
+
+int ulimit_has_command(char **argv);
+
+int is_stage_prefix(const char *word);
+
+int apply_stage_prefixes(char ***argvp);
+
+#endif
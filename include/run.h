@@ -0,0 +1,15 @@
+#ifndef RUN_H
+#define RUN_H
+
+// Entry points main.c offers to other ways of driving the shell.
+
+void run_command(char *input);
+int run_command_pending(void);
+void run_command_abandon(void);
+void run_command_cancel(void);
+int shell_last_status(void);
+void shell_set_last_status(int status);
+void shell_init_signals(int interactive);
+int shell_set_exec_in_place(int on);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+// Wire protocol for tsh --serve, on a Unix stream socket, native byte order.
+//
+// Request:  uint32_t length, then that many bytes of command line. Up to
+//           three fds (stdin, stdout, stderr, in that order) travel as
+//           SCM_RIGHTS with the first byte; missing ones become /dev/null.
+// Reply:    one tsh_reply_t once the command has finished.
+//
+// A connection may send any number of requests; they run one at a time and
+// are answered in order. Requests on different connections run concurrently.
+
+typedef struct tsh_reply {
+    int32_t status;     // exit status as $? would report it
+    int32_t reserved;
+    int64_t wall_us;
+    int64_t user_us;    // summed over every process the command ran
+    int64_t sys_us;
+    int64_t maxrss_kb;
+} tsh_reply_t;
+
+int serve(const char *path);
+
+#endif
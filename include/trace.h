@@ -0,0 +1,18 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <sys/types.h>
+#include "parser.h"
+
+int trace_open(const char *path);
+int trace_enabled(void);
+long long trace_now_us(void);
+char *trace_describe(command_t cmds[], int ncmds, const char *line, const pid_t *pids, int npids);
+void trace_pipeline(const char *desc, pid_t pgid, int jid, long long start_us, long long spawn_us,
+                    long long end_us, long long cpu_us, int status);
+void trace_flush(void);
+void trace_forget(void);
+void trace_sync(void);
+void trace_close(void);
+
+#endif
@@ -5,8 +5,15 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "builtins.h"
 #include "job_control.h"
+#include "resources.h"
+#include "coreutils.h"
+#include "trace.h"
+#include "run.h"
+#include "functions.h"
 
 #define HISTORY_SIZE 200
 
@@ -36,6 +43,56 @@ void free_history(void) {
     for (int i=0;i<history_len;i++) free(history[i]);
 }
 
+typedef struct option_desc {
+    const char *name;
+    char letter;
+} option_desc_t;
+
+static const option_desc_t option_names[OPT_COUNT] = {
+    [OPT_XTRACE]   = { "xtrace", 'x' },
+    [OPT_PIPEFAIL] = { "pipefail", 0 },
+};
+
+static int options[OPT_COUNT];
+
+int shell_option(shell_option_t opt) {
+    return options[opt];
+}
+
+// set [-x|+x] [-o name|+o name]; with no arguments or a bare -o, lists
+// the options.
+static int builtin_set(command_t *c) {
+    if (!c->argv[1] || (strcmp(c->argv[1], "-o") == 0 && !c->argv[2])) {
+        for (int i = 0; i < OPT_COUNT; i++) printf("%-15s %s\n", option_names[i].name, options[i] ? "on" : "off");
+        return 0;
+    }
+    for (int i = 1; c->argv[i]; i++) {
+        const char *arg = c->argv[i];
+        if ((arg[0] != '-' && arg[0] != '+') || !arg[1]) {
+            fprintf(stderr, "tsh: set: %s: invalid option\n", arg);
+            return 2;
+        }
+        int on = (arg[0] == '-');
+        if (strcmp(arg + 1, "o") == 0) {
+            const char *name = c->argv[++i];
+            int found = 0;
+            for (int k = 0; name && k < OPT_COUNT; k++) {
+                if (strcmp(option_names[k].name, name) == 0) { options[k] = on; found = 1; }
+            }
+            if (!found) { fprintf(stderr, "tsh: set: %s: invalid option name\n", name ? name : ""); return 2; }
+            continue;
+        }
+        for (const char *o = arg + 1; *o; o++) {
+            int found = 0;
+            for (int k = 0; k < OPT_COUNT; k++) {
+                if (option_names[k].letter == *o) { options[k] = on; found = 1; }
+            }
+            if (!found) { fprintf(stderr, "tsh: set: %c%c: invalid option\n", arg[0], *o); return 2; }
+        }
+    }
+    return 0;
+}
+
 static void print_help(void) {
     printf("tsh - Tiny enhanced shell\n");
     printf("Built-in commands:\n");
@@ -46,82 +103,391 @@ static void print_help(void) {
     printf("  history       - show command history\n");
     printf("  jobs          - list background jobs\n");
     printf("  fg %%jid       - bring background job to foreground\n");
-    printf("Features: quotes, multiple pipes, <, >, >>, background (&)\n");
+    printf("  bg %%jid       - resume stopped job in background\n");
+    printf("  wait [-n] [%%jid|pid ...] - wait for background jobs\n");
+    printf("  ulimit [-SHa] [-cdflmnstuv] [n] [cmd] - show/set limits (for cmd only if given)\n");
+    printf("  cpuset LIST cmd / nice [-n N] cmd - run a stage with cpu affinity/priority\n");
+    printf("  set [-+x] [-+o name] - toggle shell options (xtrace, pipefail)\n");
+    printf("  coproc cmd    - run cmd with pipes to ${COPROC[0]} (read), ${COPROC[1]} (write)\n");
+    printf("  exec [cmd]    - replace the shell with cmd, or apply redirections to the shell\n");
+    printf("  source FILE / . FILE - run FILE's commands in this shell\n");
+    printf("  echo, printf, test/[, true, false - run without forking\n");
+    printf("  name() { ...; } - define a function; local, return [n], shift [n] inside it\n");
+    printf("  alias [name=value] / unalias [-a] name - define or remove aliases\n");
+    printf("  unset [-f] name - remove a variable (or a function with -f)\n");
+    printf("Features: quotes, multiple pipes, <, >, >>, [n]>&m, background (&), ;, &&, ||, { ...; }\n");
 }
 
-int is_builtin(command_t *c) {
-    if (!c->argv[0]) return 0;
-    const char *b[] = {"cd","pwd","exit","help","history","jobs","fg","bg","export","unset", NULL};
-    for (int i=0;b[i];i++) if (strcmp(c->argv[0], b[i])==0) return 1;
+// Accepts "%jid" or a bare jid.
+static job_t *parse_jobspec(const char *spec) {
+    int jid = (spec[0] == '%') ? atoi(spec+1) : atoi(spec);
+    return find_job_by_jid(jid);
+}
+
+static int builtin_wait(command_t *c) {
+    if (!c->argv[1]) {
+        job_t *j;
+        while ((j = wait_any_job(NULL, 0))) remove_job(j);
+        return wait_interrupted() ? 130 : 0;
+    }
+    if (strcmp(c->argv[1], "-n") == 0) {
+        // wait -n [%jid|pid ...]: only the jobs named, if any, count.
+        job_t *only[MAX_ARGS];
+        int nonly = 0;
+        for (int i = 2; c->argv[i]; i++) {
+            const char *arg = c->argv[i];
+            job_t *j = arg[0] == '%' ? parse_jobspec(arg) : find_job_by_pid(atoi(arg), NULL);
+            if (j) only[nonly++] = j;
+            else fprintf(stderr, "tsh: wait: %s: no such job\n", arg);
+        }
+        if (c->argv[2] && nonly == 0) return 127;
+        job_t *j = wait_any_job(only, nonly);
+        if (!j) return wait_interrupted() ? 130 : 127;
+        int status = job_exit_status(j);
+        remove_job(j);
+        return status;
+    }
+
+    int status = 0;
+    for (int i = 1; c->argv[i]; i++) {
+        const char *arg = c->argv[i];
+        if (arg[0] == '%') {
+            job_t *j = parse_jobspec(arg);
+            if (!j) { fprintf(stderr, "tsh: wait: %s: no such job\n", arg); status = 127; continue; }
+            status = wait_for_job(j);
+            if (j->state == JOB_DONE) remove_job(j);
+            if (wait_interrupted()) break;
+        } else {
+            pid_t pid = atoi(arg);
+            if (pid <= 0 || !find_job_by_pid(pid, NULL)) {
+                fprintf(stderr, "tsh: wait: pid %s is not a child of this shell\n", arg);
+                status = 127;
+                continue;
+            }
+            status = wait_for_pid(pid);
+            job_t *j = find_job_by_pid(pid, NULL);
+            if (j && j->state == JOB_DONE) remove_job(j);
+            if (wait_interrupted()) break;
+        }
+    }
+    return status;
+}
+
+static int builtin_exit(command_t *c) {
+    exit(c->argv[1] ? atoi(c->argv[1]) : 0);
+}
+
+static int builtin_cd(command_t *c) {
+    const char *dir = c->argv[1] ? c->argv[1] : getenv("HOME");
+    if (!dir || chdir(dir) != 0) { perror("tsh: cd"); return 1; }
+    return 0;
+}
+
+static int builtin_pwd(command_t *c) {
+    (void)c;
+    char cwd[4096]; if (!getcwd(cwd, sizeof(cwd))) { perror("tsh: pwd"); return 1; }
+    printf("%s\n", cwd);
+    return 0;
+}
+
+static int builtin_help(command_t *c) {
+    (void)c;
+    print_help();
+    return 0;
+}
+
+static int builtin_history(command_t *c) {
+    (void)c;
+    for (int i=0;i<history_len;i++) printf("%4d  %s\n", i+1, history[i]);
     return 0;
 }
 
-int handle_builtin(command_t *c) {
-    if (!c->argv[0]) return 0;
-    if (strcmp(c->argv[0], "exit") == 0) {
-        exit(0);
+static int builtin_jobs(command_t *c) {
+    (void)c;
+    print_jobs();
+    return 0;
+}
+
+// fg or bg on a job that finished before it was collected: report it
+// like jobs does and return its status.
+static int collect_done_job(job_t *j) {
+    printf("[%d] Done   %s\n", j->jid, j->cmdline);
+    int status = job_exit_status(j);
+    remove_job(j);
+    return status;
+}
+
+static int builtin_fg(command_t *c) {
+    if (!c->argv[1]) { fprintf(stderr, "tsh: fg: expected %%jid\n"); return 1; }
+    job_t *j = parse_jobspec(c->argv[1]);
+    if (!j) { fprintf(stderr, "tsh: fg: job not found\n"); return 1; }
+    if (job_continue(j, 1) < 0) return collect_done_job(j);
+    
+    int status = wait_for_job(j);
+    j->foreground = 0;
+    terminal_reclaim(j);
+    if (j->state == JOB_STOPPED) {
+        printf("\n[%d] Stopped   %s\n", j->jid, j->cmdline);
+        return status;
     }
-    if (strcmp(c->argv[0], "cd") == 0) {
-        const char *dir = c->argv[1] ? c->argv[1] : getenv("HOME");
-        if (!dir || chdir(dir) != 0) perror("tsh: cd");
-        return 1;
+    // Still running if the wait was interrupted; it stays a job.
+    if (j->state != JOB_DONE) return status;
+    remove_job(j);
+    return status;
+}
+
+static int builtin_bg(command_t *c) {
+    if (!c->argv[1]) { fprintf(stderr, "tsh: bg: expected %%jid\n"); return 1; }
+    job_t *j = parse_jobspec(c->argv[1]);
+    if (!j) { fprintf(stderr, "tsh: bg: job not found\n"); return 1; }
+    if (job_continue(j, 0) < 0) return collect_done_job(j);
+    
+    printf("[%d] %s\n", j->jid, j->cmdline);
+    return 0; 
+}
+
+static int builtin_export(command_t *c) {
+    if (!c->argv[1]) return 0;
+    char *p = strchr(c->argv[1], '=');
+    if (p) {
+        *p = '\0';
+        setenv(c->argv[1], p+1, 1);
+    }
+    return 0;
+}
+
+// unset [-f|-v] name...
+static int builtin_unset(command_t *c) {
+    int i = 1, functions = 0;
+    if (c->argv[1] && (strcmp(c->argv[1], "-f") == 0 || strcmp(c->argv[1], "-v") == 0)) {
+        functions = (c->argv[1][1] == 'f');
+        i++;
+    }
+    for (; c->argv[i]; i++) {
+        if (functions) function_unset(c->argv[i]);
+        else unsetenv(c->argv[i]);
+    }
+    return 0;
+}
+
+// local NAME[=value]...: the variables get their old values back when the
+// function returns.
+static int builtin_local(command_t *c) {
+    for (int i = 1; c->argv[i]; i++) {
+        if (local_declare(c->argv[i]) < 0) {
+            fprintf(stderr, "tsh: local: can only be used in a function\n");
+            return 1;
+        }
     }
-    if (strcmp(c->argv[0], "pwd") == 0) {
-        char cwd[4096]; if (getcwd(cwd, sizeof(cwd))) printf("%s\n", cwd);
+    return 0;
+}
+
+static int source_depth = 0;
+
+// return [n]: leave the function or sourced file, with status n or that of
+// the last command.
+static int builtin_return(command_t *c) {
+    if (function_depth() == 0 && source_depth == 0) {
+        fprintf(stderr, "tsh: return: can only `return' from a function or sourced script\n");
         return 1;
     }
-    if (strcmp(c->argv[0], "help") == 0) { print_help(); return 1; }
-    if (strcmp(c->argv[0], "history") == 0) {
-        for (int i=0;i<history_len;i++) printf("%4d  %s", i+1, history[i]);
+    int status = c->argv[1] ? atoi(c->argv[1]) & 255 : shell_last_status();
+    return_request(status);
+    return status;
+}
+
+static int builtin_shift(command_t *c) {
+    int n = c->argv[1] ? atoi(c->argv[1]) : 1;
+    if (params_shift(n) < 0) {
+        fprintf(stderr, "tsh: shift: %s: shift count out of range\n", c->argv[1] ? c->argv[1] : "1");
         return 1;
     }
-    if (strcmp(c->argv[0], "jobs") == 0) { print_jobs(); return 1; }
-    if (strcmp(c->argv[0], "fg") == 0) {
-        if (!c->argv[1]) { fprintf(stderr, "tsh: fg: expected %%jid\n"); return 1; }
-        int jid = 0;
-        if (c->argv[1][0] == '%') jid = atoi(c->argv[1]+1); else jid = atoi(c->argv[1]);
-        job_t *j = find_job_by_jid(jid);
-        if (!j) { fprintf(stderr, "tsh: fg: job not found\n"); return 1; }
-        
-        j->state = JOB_RUNNING;
-        kill(-j->pgid, SIGCONT);
-        
-        int status;
-        while (waitpid(-j->pgid, &status, WUNTRACED) > 0) {
-            if (WIFSTOPPED(status)) {
-                j->state = JOB_STOPPED;
-                printf("\n[%d] Stopped   %s\n", j->jid, j->cmdline);
-                return 1;
+    return 0;
+}
+
+// alias [name[=value]...]: defines aliases, or prints them.
+static int builtin_alias(command_t *c) {
+    if (!c->argv[1]) {
+        alias_print();
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; c->argv[i]; i++) {
+        char *eq = strchr(c->argv[i], '=');
+        if (!eq) {
+            const char *value = alias_get(c->argv[i]);
+            if (value) printf("alias %s='%s'\n", c->argv[i], value);
+            else { fprintf(stderr, "tsh: alias: %s: not found\n", c->argv[i]); status = 1; }
+            continue;
+        }
+        *eq = '\0';
+        if (alias_set(c->argv[i], eq + 1) < 0) {
+            fprintf(stderr, "tsh: alias: `%s': invalid alias name\n", c->argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// unalias [-a] name...
+static int builtin_unalias(command_t *c) {
+    if (c->argv[1] && strcmp(c->argv[1], "-a") == 0) {
+        alias_clear();
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; c->argv[i]; i++) {
+        if (alias_unset(c->argv[i]) < 0) { fprintf(stderr, "tsh: unalias: %s: not found\n", c->argv[i]); status = 1; }
+    }
+    return status;
+}
+
+static int builtin_true(command_t *c) {
+    (void)c;
+    return 0;
+}
+
+static int builtin_false(command_t *c) {
+    (void)c;
+    return 1;
+}
+
+static int builtin_echo_cmd(command_t *c)   { return builtin_echo(c->argv); }
+static int builtin_printf_cmd(command_t *c) { return builtin_printf(c->argv); }
+static int builtin_test_cmd(command_t *c)   { return builtin_test(c->argv); }
+static int builtin_ulimit_cmd(command_t *c) { return builtin_ulimit(c->argv); }
+
+// exec cmd...: replace the shell with cmd. The caller has applied the
+// redirections for good (see BUILTIN_KEEP_REDIRS), so "exec 3>file" has
+// nothing left to do here.
+static int builtin_exec(command_t *c) {
+    char **argv = c->argv + 1;
+    if (!argv[0]) return 0;
+    if (apply_stage_prefixes(&argv) < 0) return 1;
+
+    // Ignored signals would stay ignored across exec; put them back the way
+    // a freshly started program expects, and restore them if exec fails.
+    static const int sigs[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGPIPE };
+    struct sigaction dfl, old[sizeof(sigs) / sizeof(sigs[0])];
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    fflush(stdout);
+    trace_sync();
+    for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) sigaction(sigs[i], &dfl, &old[i]);
+
+    execvp(argv[0], argv);
+    int err = errno;
+    for (size_t i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) sigaction(sigs[i], &old[i], NULL);
+    fprintf(stderr, "tsh: exec: %s: %s\n", argv[0], strerror(err));
+    return err == ENOENT ? 127 : 126;
+}
+
+#define MAX_SOURCE_DEPTH 32
+
+// source FILE [args] / . FILE [args]: run FILE's lines in the current
+// shell, with args as $1... if given. A name without a slash is looked up
+// in PATH first, then in the current directory.
+static int builtin_source(command_t *c) {
+    const char *name = c->argv[1];
+    if (!name) { fprintf(stderr, "tsh: %s: filename argument required\n", c->argv[0]); return 2; }
+    if (source_depth >= MAX_SOURCE_DEPTH) { fprintf(stderr, "tsh: %s: %s: nested too deeply\n", c->argv[0], name); return 1; }
+
+    FILE *f = NULL;
+    const char *path = getenv("PATH");
+    if (!strchr(name, '/') && path) {
+        char full[4096];
+        for (const char *p = path; !f; p++) {
+            const char *end = strchr(p, ':');
+            size_t len = end ? (size_t)(end - p) : strlen(p);
+            if (len > 0 && snprintf(full, sizeof(full), "%.*s/%s", (int)len, p, name) < (int)sizeof(full)) {
+                struct stat st;
+                if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) f = fopen(full, "r");
             }
+            if (!end) break;
+            p = end;
         }
-        remove_job(j);
-        return 1;
     }
-    if (strcmp(c->argv[0], "bg") == 0) {
-        if (!c->argv[1]) { fprintf(stderr, "tsh: bg: expected %%jid\n"); return 1; }
-        int jid = 0;
-        if (c->argv[1][0] == '%') jid = atoi(c->argv[1]+1); else jid = atoi(c->argv[1]);
-        job_t *j = find_job_by_jid(jid);
-        if (!j) { fprintf(stderr, "tsh: bg: job not found\n"); return 1; }
-        
-        j->state = JOB_RUNNING;
-        kill(-j->pgid, SIGCONT);
-        printf("[%d] %s\n", j->jid, j->cmdline);
-        return 1; 
-    }
-    if (strcmp(c->argv[0], "export") == 0) {
-        if (!c->argv[1]) return 1;
-        char *p = strchr(c->argv[1], '=');
-        if (p) {
-            *p = '\0';
-            setenv(c->argv[1], p+1, 1);
+    if (!f) f = fopen(name, "r");
+    if (!f) { fprintf(stderr, "tsh: %s: %s: %s\n", c->argv[0], name, strerror(errno)); return 1; }
+    fcntl(fileno(f), F_SETFD, FD_CLOEXEC);
+
+    int args = c->argv[2] != NULL;
+    if (args) {
+        int argc = 1;
+        while (c->argv[argc]) argc++;
+        if (params_push(argc - 1, c->argv + 1, 0) < 0) {
+            fprintf(stderr, "tsh: %s: %s: nested too deeply\n", c->argv[0], name);
+            fclose(f);
+            return 1;
         }
-        return 1;
     }
-    if (strcmp(c->argv[0], "unset") == 0) {
-        if (!c->argv[1]) return 1;
-        unsetenv(c->argv[1]);
-        return 1;
+    // A file with no commands in it succeeds. Each line is run as if it
+    // ended the input, so a subshell or server worker must not exec its
+    // last command in place: the rest of the file and the caller follow.
+    shell_set_last_status(0);
+    int in_place = shell_set_exec_in_place(0);
+    source_depth++;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while (!return_pending() && (len = getline(&line, &cap, f)) != -1) {
+        if (len > 0 && line[len-1] == '\n') line[len-1] = '\0';
+        run_command(line);
     }
-    return 0;
+    run_command_abandon();
+    source_depth--;
+    shell_set_exec_in_place(in_place);
+    if (args) params_pop();
+    free(line);
+    fclose(f);
+    return return_pending() ? return_take() : shell_last_status();
+}
+
+// Kept in strcmp order for bsearch.
+static const builtin_t builtins[] = {
+    { ".",       builtin_source,     0 },
+    { "[",       builtin_test_cmd,   0 },
+    { "alias",   builtin_alias,      0 },
+    { "bg",      builtin_bg,         0 },
+    { "cd",      builtin_cd,         0 },
+    { "echo",    builtin_echo_cmd,   0 },
+    { "exec",    builtin_exec,       BUILTIN_KEEP_REDIRS },
+    { "exit",    builtin_exit,       0 },
+    { "export",  builtin_export,     0 },
+    { "false",   builtin_false,      0 },
+    { "fg",      builtin_fg,         0 },
+    { "help",    builtin_help,       0 },
+    { "history", builtin_history,    0 },
+    { "jobs",    builtin_jobs,       0 },
+    { "local",   builtin_local,      0 },
+    { "printf",  builtin_printf_cmd, 0 },
+    { "pwd",     builtin_pwd,        0 },
+    { "return",  builtin_return,     0 },
+    { "set",     builtin_set,        0 },
+    { "shift",   builtin_shift,      0 },
+    { "source",  builtin_source,     0 },
+    { "test",    builtin_test_cmd,   0 },
+    { "true",    builtin_true,       0 },
+    { "ulimit",  builtin_ulimit_cmd, 0 },
+    { "unalias", builtin_unalias,    0 },
+    { "unset",   builtin_unset,      0 },
+    { "wait",    builtin_wait,       0 },
+};
+
+static int compare_builtin(const void *key, const void *entry) {
+    return strcmp((const char *)key, ((const builtin_t *)entry)->name);
+}
+
+const builtin_t *find_builtin(command_t *c) {
+    if (!c->argv[0]) return NULL;
+    const builtin_t *b = bsearch(c->argv[0], builtins, sizeof(builtins) / sizeof(builtins[0]),
+                                 sizeof(builtins[0]), compare_builtin);
+    // "ulimit -v N cmd" limits just cmd, in its child.
+    if (b && b->fn == builtin_ulimit_cmd && ulimit_has_command(c->argv)) return NULL;
+    return b;
+}
+
+// Looked up in the sorted table above; the caller runs find_builtin(c)->fn.
+int is_builtin(command_t *c) {
+    return find_builtin(c) != NULL;
 }
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "coreutils.h"
+
+// In-process versions of echo, printf and test/[, so scripts don't pay a
+// fork and exec for each one. They follow POSIX and the common GNU
+// extensions, not every corner of either.
+
+// Decodes the escape starting just past a backslash at s[*i], appending the
+// byte to out (or writing it to stdout when out is NULL). In echo and %b
+// octal escapes are \0nnn; in a printf format they are \nnn. Returns 1 on
+// \c, which ends all output.
+static int decode_escape(const char *s, size_t *i, int zero_octal, char *out, size_t *outlen) {
+    int c = s[*i];
+    int value;
+    switch (c) {
+        case 'a':  value = '\a'; break;
+        case 'b':  value = '\b'; break;
+        case 'e':  value = 033;  break;
+        case 'f':  value = '\f'; break;
+        case 'n':  value = '\n'; break;
+        case 'r':  value = '\r'; break;
+        case 't':  value = '\t'; break;
+        case 'v':  value = '\v'; break;
+        case '\\': value = '\\'; break;
+        case 'c':  (*i)++; return 1;
+        case '\0': value = '\\'; (*i)--; break;  // trailing backslash is literal
+        default:
+            if (c >= '0' && c <= '7' && (!zero_octal || c == '0')) {
+                int max = zero_octal ? 3 : 2;
+                value = zero_octal ? 0 : c - '0';
+                for (int k = 0; k < max && s[*i + 1] >= '0' && s[*i + 1] <= '7'; k++)
+                    value = value * 8 + (s[++*i] - '0');
+            } else {
+                // Unknown escapes are kept as written.
+                if (out) out[(*outlen)++] = '\\';
+                else putchar('\\');
+                value = c;
+            }
+    }
+    (*i)++;
+    if (out) out[(*outlen)++] = (char)value;
+    else putchar(value);
+    return 0;
+}
+
+// echo [-neE] [arg ...]
+int builtin_echo(char **argv) {
+    int newline = 1, escapes = 0;
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        const char *o = argv[i] + 1;
+        if (o[strspn(o, "neE")] != '\0') break;
+        for (; *o; o++) {
+            if (*o == 'n') newline = 0;
+            else escapes = (*o == 'e');
+        }
+    }
+    for (int first = i; argv[i]; i++) {
+        if (i > first) putchar(' ');
+        if (!escapes) { fputs(argv[i], stdout); continue; }
+        for (size_t k = 0; argv[i][k]; ) {
+            if (argv[i][k] != '\\') { putchar(argv[i][k++]); continue; }
+            k++;
+            if (decode_escape(argv[i], &k, 1, NULL, NULL)) return 0;
+        }
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+// A leading quote gives the character code of what follows, as in
+// printf '%d' "'A".
+static int numeric_arg(const char *arg, long long *ll, unsigned long long *ull, double *d) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        unsigned char code = arg[1];
+        if (ll)  *ll = code;
+        if (ull) *ull = code;
+        if (d)   *d = code;
+        return 0;
+    }
+    if (*arg == '\0') return 0;
+    char *end;
+    errno = 0;
+    if (ll)  *ll = strtoll(arg, &end, 0);
+    if (ull) *ull = (arg[0] == '-') ? (unsigned long long)strtoll(arg, &end, 0) : strtoull(arg, &end, 0);
+    if (d)   *d = strtod(arg, &end);
+    if (end == arg || *end != '\0' || errno) {
+        fprintf(stderr, "tsh: printf: %s: invalid number\n", arg);
+        return 1;
+    }
+    return 0;
+}
+
+// printf FORMAT [arg ...]: the format is reused until the arguments run
+// out; missing ones read as "" or 0.
+int builtin_printf(char **argv) {
+    if (!argv[1]) { fprintf(stderr, "tsh: printf: usage: printf format [arguments]\n"); return 2; }
+    const char *fmt = argv[1];
+    char **args = argv + 2;
+    int status = 0;
+
+    for (;;) {
+        char **round = args;
+        for (size_t i = 0; fmt[i]; ) {
+            if (fmt[i] == '\\') {
+                i++;
+                if (decode_escape(fmt, &i, 0, NULL, NULL)) return status;
+                continue;
+            }
+            if (fmt[i] != '%') { putchar(fmt[i++]); continue; }
+            if (fmt[i + 1] == '%') { putchar('%'); i += 2; continue; }
+
+            // Copy "%[flags][width][.precision]" into spec, resolving '*'.
+            char spec[64];
+            size_t n = 0;
+            spec[n++] = fmt[i++];
+            while (fmt[i] && strchr("-+ #0", fmt[i]) && n < 16) spec[n++] = fmt[i++];
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (fmt[i] != '.') break;
+                    spec[n++] = fmt[i++];
+                }
+                if (fmt[i] == '*') {
+                    long long w = 0;
+                    if (*args && numeric_arg(*args, &w, NULL, NULL)) status = 1;
+                    if (*args) args++;
+                    n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)w);
+                    i++;
+                } else {
+                    while (isdigit((unsigned char)fmt[i]) && n < 48) spec[n++] = fmt[i++];
+                }
+            }
+
+            char conv = fmt[i];
+            if (!conv) { fprintf(stderr, "tsh: printf: %s: missing conversion\n", fmt); return 1; }
+            i++;
+            const char *arg = *args ? *args++ : NULL;
+            long long ll = 0;
+            unsigned long long ull = 0;
+            double d = 0;
+            switch (conv) {
+                case 'd': case 'i':
+                    if (arg && numeric_arg(arg, &ll, NULL, NULL)) status = 1;
+                    strcpy(spec + n, "lld");
+                    printf(spec, ll);
+                    break;
+                case 'o': case 'u': case 'x': case 'X':
+                    if (arg && numeric_arg(arg, NULL, &ull, NULL)) status = 1;
+                    spec[n] = 'l'; spec[n + 1] = 'l'; spec[n + 2] = conv; spec[n + 3] = '\0';
+                    printf(spec, ull);
+                    break;
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+                    if (arg && numeric_arg(arg, NULL, NULL, &d)) status = 1;
+                    spec[n] = conv; spec[n + 1] = '\0';
+                    printf(spec, d);
+                    break;
+                case 'c':
+                    if (arg && *arg) putchar(*arg);
+                    break;
+                case 's':
+                    strcpy(spec + n, "s");
+                    printf(spec, arg ? arg : "");
+                    break;
+                case 'b': {
+                    const char *s = arg ? arg : "";
+                    char *buf = malloc(strlen(s) + 2);
+                    if (!buf) return 1;
+                    size_t len = 0;
+                    int stop = 0;
+                    for (size_t k = 0; s[k] && !stop; ) {
+                        if (s[k] != '\\') { buf[len++] = s[k++]; continue; }
+                        k++;
+                        stop = decode_escape(s, &k, 1, buf, &len);
+                    }
+                    buf[len] = '\0';
+                    strcpy(spec + n, "s");
+                    printf(spec, buf);
+                    free(buf);
+                    if (stop) return status;
+                    break;
+                }
+                default:
+                    fprintf(stderr, "tsh: printf: %%%c: invalid conversion\n", conv);
+                    return 1;
+            }
+        }
+        if (!*args || args == round) break;
+    }
+    return status;
+}
+
+typedef struct test_state {
+    char **argv;
+    int argc;
+    int pos;
+    const char *err;        // syntax error message
+    const char *bad_int;    // operand of -eq etc. that is not an integer
+} test_state_t;
+
+static int is_int(const char *s, long long *v) {
+    char *end;
+    errno = 0;
+    while (isspace((unsigned char)*s)) s++;
+    *v = strtoll(s, &end, 10);
+    return end != s && *end == '\0' && !errno;
+}
+
+static int test_unary(const char *op, const char *arg) {
+    struct stat st;
+    switch (op[1]) {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 't': return isatty(atoi(arg));
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+        case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) != 0) return 0;
+    switch (op[1]) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+    }
+    return 0;
+}
+
+static int is_unary_op(const char *s) {
+    return s[0] == '-' && s[1] && !s[2] && strchr("nztrwxhLefdspSbcugk", s[1]);
+}
+
+static const char *const binary_ops[] = {
+    "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL
+};
+
+static int is_binary_op(const char *s) {
+    for (int i = 0; binary_ops[i]; i++) if (strcmp(s, binary_ops[i]) == 0) return 1;
+    return 0;
+}
+
+static int test_binary(test_state_t *t, const char *a, const char *op, const char *b) {
+    if (op[0] != '-') {
+        int cmp = strcmp(a, b);
+        if (op[0] == '!') return cmp != 0;
+        if (op[0] == '<') return cmp < 0;
+        if (op[0] == '>') return cmp > 0;
+        return cmp == 0;
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (op[1] == 'o') {
+            const char *tmp = a; a = b; b = tmp;
+            struct stat ts = sa; sa = sb; sb = ts;
+            int th = ha; ha = hb; hb = th;
+        }
+        // a is newer than b, or exists when b does not.
+        return ha && (!hb || sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+                      (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec));
+    }
+    long long x, y;
+    if (!is_int(a, &x)) { t->bad_int = a; return 0; }
+    if (!is_int(b, &y)) { t->bad_int = b; return 0; }
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+static int test_or(test_state_t *t);
+
+static int test_primary(test_state_t *t) {
+    if (t->pos >= t->argc) { t->err = "argument expected"; return 0; }
+    char **a = t->argv + t->pos;
+    int left = t->argc - t->pos;
+
+    if (left >= 3 && is_binary_op(a[1])) {
+        t->pos += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "!") == 0) {
+        t->pos++;
+        return !test_primary(t);
+    }
+    if (strcmp(a[0], "(") == 0 && left >= 2) {
+        t->pos++;
+        int v = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) { if (!t->err) t->err = "')' expected"; return 0; }
+        t->pos++;
+        return v;
+    }
+    if (left >= 2 && is_unary_op(a[0])) {
+        t->pos += 2;
+        return test_unary(a[0], a[1]);
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+static int test_and(test_state_t *t) {
+    int v = test_primary(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        int r = test_primary(t);
+        v = v && r;
+    }
+    return v;
+}
+
+static int test_or(test_state_t *t) {
+    int v = test_and(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        int r = test_and(t);
+        v = v || r;
+    }
+    return v;
+}
+
+// test expr / [ expr ]: 0 if true, 1 if false, 2 on a malformed expression.
+int builtin_test(char **argv) {
+    const char *name = argv[0];
+    int argc = 0;
+    while (argv[argc + 1]) argc++;
+    if (strcmp(name, "[") == 0) {
+        if (argc == 0 || strcmp(argv[argc], "]") != 0) { fprintf(stderr, "tsh: [: missing ']'\n"); return 2; }
+        argc--;
+    }
+
+    test_state_t t = { argv + 1, argc, 0, NULL, NULL };
+    if (argc == 0) return 1;
+    if (argc == 1) return argv[1][0] == '\0';
+
+    int v = test_or(&t);
+    if (!t.err && t.pos < t.argc) t.err = "too many arguments";
+    if (t.err) { fprintf(stderr, "tsh: %s: %s\n", name, t.err); return 2; }
+    if (t.bad_int) { fprintf(stderr, "tsh: %s: %s: integer expression expected\n", name, t.bad_int); return 2; }
+    return !v;
+}
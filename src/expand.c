@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <glob.h>
+#include "parser.h"
+#include "expand.h"
+
+// Turns a parsed stage into argv: quote removal, $-expansion, field
+// splitting and globbing, in the order POSIX gives them. Only unquoted
+// text is split or globbed, whether it was written out or came from a
+// variable.
+
+typedef struct expander {
+    const expand_ctx_t *ctx;
+    command_t *c;
+    int argc;
+    int split;          // 0 for redirection targets: one field, taken as is
+    int err;
+    char *lit;          // current field
+    size_t len, cap;
+    char *pat;          // the same field as a glob pattern, quoted chars escaped
+    size_t plen, pcap;
+    int active;         // a field has begun (quotes alone start one)
+    int glob;           // the field has an unquoted * ? or [
+} expander_t;
+
+static int reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t n = *cap ? *cap * 2 : 64;
+    while (n < need) n *= 2;
+    char *p = realloc(*buf, n);
+    if (!p) return -1;
+    *buf = p;
+    *cap = n;
+    return 0;
+}
+
+static void put(expander_t *ex, char ch, int quoted) {
+    if (reserve(&ex->lit, &ex->cap, ex->len + 2) < 0 || reserve(&ex->pat, &ex->pcap, ex->plen + 3) < 0) {
+        ex->err = 1;
+        return;
+    }
+    ex->lit[ex->len++] = ch;
+    if (ch == '\\' || (quoted && strchr("*?[", ch))) ex->pat[ex->plen++] = '\\';
+    ex->pat[ex->plen++] = ch;
+    if (!quoted && strchr("*?[", ch)) ex->glob = 1;
+    ex->active = 1;
+}
+
+static void add_arg(expander_t *ex, const char *s) {
+    if (ex->argc >= MAX_ARGS - 1) {
+        if (!ex->err) fprintf(stderr, "tsh: too many args\n");
+        ex->err = 1;
+        return;
+    }
+    char *copy = strdup(s);
+    if (!copy) { ex->err = 1; return; }
+    command_t *c = ex->c;
+    c->owned[c->nowned++] = copy;
+    c->argv[ex->argc++] = copy;
+}
+
+// Like add_arg, for a string c already owns.
+static void add_field(expander_t *ex, char *s) {
+    if (ex->argc >= MAX_ARGS - 1) {
+        if (!ex->err) fprintf(stderr, "tsh: too many args\n");
+        ex->err = 1;
+        return;
+    }
+    ex->c->argv[ex->argc++] = s;
+}
+
+static void end_field(expander_t *ex) {
+    if (!ex->active || !ex->split) return;
+    // Quotes alone start a field without storing anything.
+    if (reserve(&ex->lit, &ex->cap, ex->len + 1) < 0 || reserve(&ex->pat, &ex->pcap, ex->plen + 1) < 0) {
+        ex->err = 1;
+        return;
+    }
+    ex->lit[ex->len] = '\0';
+    ex->pat[ex->plen] = '\0';
+    glob_t g;
+    memset(&g, 0, sizeof(g));
+    // A pattern that matches nothing stays as written.
+    if (ex->glob && glob(ex->pat, 0, NULL, &g) == 0) {
+        for (size_t i = 0; i < g.gl_pathc; i++) add_arg(ex, g.gl_pathv[i]);
+    } else {
+        add_arg(ex, ex->lit);
+    }
+    if (ex->glob) globfree(&g);
+    ex->len = ex->plen = 0;
+    ex->active = ex->glob = 0;
+}
+
+// Appends a value. Unquoted, whitespace separates fields.
+static void emit(expander_t *ex, const char *s, size_t n, int quoted) {
+    if (quoted) ex->active = 1;
+    for (size_t i = 0; i < n; i++) {
+        if (!quoted && ex->split && isspace((unsigned char)s[i])) end_field(ex);
+        else put(ex, s[i], quoted);
+    }
+}
+
+// Picks the idx-th whitespace separated field out of an "array" value.
+static const char *array_field(const char *val, int idx, size_t *len) {
+    const char *p = val;
+    for (;;) {
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '\0') { *len = 0; return p; }
+        const char *start = p;
+        while (*p && !isspace((unsigned char)*p)) p++;
+        if (idx-- == 0) { *len = p - start; return start; }
+    }
+}
+
+// $@ and $*: "$@" gives one field per parameter, "$*" joins them with
+// spaces, and unquoted both are split like any other value.
+static void emit_params(expander_t *ex, char which, int quoted) {
+    const expand_ctx_t *ctx = ex->ctx;
+    for (int i = 1; i < ctx->argc; i++) {
+        if (i > 1) {
+            if (!ex->split || (quoted && which == '*')) put(ex, ' ', 1);
+            else { if (quoted) ex->active = 1; end_field(ex); }
+        }
+        emit(ex, ctx->argv[i], strlen(ctx->argv[i]), quoted);
+    }
+}
+
+// Expands the parameter just past a '$' at *pp and advances *pp. Handles
+// $NAME, ${NAME}, ${NAME[i]}, ${NAME[@]}, ${#NAME}, $0-$9, ${10}, $#, $@,
+// $*, $?, $! and $$.
+static void expand_param(expander_t *ex, const char **pp, int quoted) {
+    const expand_ctx_t *ctx = ex->ctx;
+    const char *p = *pp;
+    int braced = 0, length = 0, idx = -1;
+
+    if (*p == '{' && strchr(p, '}')) {
+        braced = 1;
+        p++;
+        if (*p == '#' && p[1] != '}') { length = 1; p++; }
+    }
+
+    char name[256];
+    size_t n = 0;
+    if (*p && strchr("?!$#@*", *p)) {
+        name[n++] = *p++;
+    } else if (isdigit((unsigned char)*p)) {
+        do name[n++] = *p++; while (braced && isdigit((unsigned char)*p) && n < 16);
+    } else {
+        while ((isalnum((unsigned char)*p) || *p == '_') && n < sizeof(name) - 1) name[n++] = *p++;
+    }
+    name[n] = '\0';
+    if (n == 0) { put(ex, '$', quoted); return; }
+
+    if (braced) {
+        // ${NAME[@]} is the whole value.
+        if (*p == '[') {
+            p++;
+            if (*p == '@' || *p == '*') p++;
+            else idx = atoi(p);
+            while (*p && *p != ']' && *p != '}') p++;
+            if (*p == ']') p++;
+        }
+        while (*p && *p != '}') p++;    // operators such as ${x:-y} are not supported
+        if (*p == '}') p++;
+    }
+    *pp = p;
+
+    char num[32];
+    const char *val = "";
+    if (name[0] == '@' || name[0] == '*') {
+        if (!length) { emit_params(ex, name[0], quoted); return; }
+        snprintf(num, sizeof(num), "%d", ctx->argc > 1 ? ctx->argc - 1 : 0);
+        val = num;
+        length = 0;
+    } else if (name[0] == '?') {
+        snprintf(num, sizeof(num), "%d", ctx->last_status);
+        val = num;
+    } else if (name[0] == '!') {
+        if (ctx->last_bg_pid > 0) { snprintf(num, sizeof(num), "%d", (int)ctx->last_bg_pid); val = num; }
+    } else if (name[0] == '$') {
+        snprintf(num, sizeof(num), "%d", (int)getpid());
+        val = num;
+    } else if (name[0] == '#') {
+        snprintf(num, sizeof(num), "%d", ctx->argc > 1 ? ctx->argc - 1 : 0);
+        val = num;
+    } else if (isdigit((unsigned char)name[0])) {
+        int k = atoi(name);
+        if (k == 0) val = ctx->argc > 0 ? ctx->argv[0] : "tsh";
+        else if (k < ctx->argc) val = ctx->argv[k];
+    } else {
+        const char *v = ctx->shell_var ? ctx->shell_var(name) : NULL;
+        if (!v) v = getenv(name);
+        if (v) val = v;
+    }
+
+    size_t len = strlen(val);
+    if (idx >= 0) val = array_field(val, idx, &len);
+    if (length) {
+        snprintf(num, sizeof(num), "%zu", len);
+        val = num;
+        len = strlen(num);
+    }
+    emit(ex, val, len, quoted);
+}
+
+static void expand_word(expander_t *ex, const char *word) {
+    int in_dq = 0;
+    const char *p = word;
+    while (*p && !ex->err) {
+        char ch = *p;
+        if (ch == '\'' && !in_dq) {
+            ex->active = 1;
+            for (p++; *p && *p != '\''; p++) put(ex, *p, 1);
+            if (*p) p++;
+        } else if (ch == '"') {
+            in_dq = !in_dq;
+            ex->active = 1;
+            p++;
+        } else if (ch == '\\') {
+            char next = p[1];
+            if (next == '\n') { p += 2; continue; }
+            if (!next || (in_dq && !strchr("$`\"\\", next))) { put(ex, '\\', 1); p++; continue; }
+            put(ex, next, 1);
+            p += 2;
+        } else if (ch == '$') {
+            p++;
+            expand_param(ex, &p, in_dq);
+        } else if (ch == '~' && p == word && (p[1] == '/' || p[1] == '\0')) {
+            const char *home = getenv("HOME");
+            if (!home) home = "~";
+            emit(ex, home, strlen(home), 1);
+            p++;
+        } else {
+            put(ex, ch, in_dq);
+            p++;
+        }
+    }
+    end_field(ex);
+}
+
+// Expands word as a single field, without splitting or globbing, and
+// returns a copy c owns.
+static char *expand_whole(expander_t *ex, const char *word) {
+    int split = ex->split;
+    ex->split = 0;
+    expand_word(ex, word);
+    ex->split = split;
+    if (ex->err) return NULL;
+    char *s = strndup(ex->lit ? ex->lit : "", ex->len);
+    ex->len = ex->plen = 0;
+    ex->active = ex->glob = 0;
+    if (!s) { ex->err = 1; return NULL; }
+    ex->c->owned[ex->c->nowned++] = s;
+    return s;
+}
+
+int is_assignment(const char *word) {
+    if (!isalpha((unsigned char)*word) && *word != '_') return 0;
+    while (isalnum((unsigned char)*word) || *word == '_') word++;
+    return *word == '=';
+}
+
+// Fills c from st. Every string in c is owned by c; release them with
+// free_commands. Returns -1 after printing an error.
+int expand_command(const stage_t *st, const expand_ctx_t *ctx, command_t *c) {
+    expander_t ex;
+    memset(&ex, 0, sizeof(ex));
+    ex.ctx = ctx;
+    ex.c = c;
+    ex.split = 1;
+    c->nowned = 0;
+    c->nredirs = 0;
+    c->group = st->group;
+
+    // Assignments are one field each, whether they lead the command or
+    // are arguments to export or local.
+    int assigning = 1;
+    int declaring = st->nwords > 0 && (strcmp(st->words[0], "export") == 0 || strcmp(st->words[0], "local") == 0);
+    for (int i = 0; i < st->nwords && !ex.err; i++) {
+        // "$@" with no parameters is no field at all, not an empty one.
+        const char *w = st->words[i];
+        if (ctx->argc <= 1 && (strcmp(w, "\"$@\"") == 0 || strcmp(w, "\"${@}\"") == 0)) continue;
+        if (!is_assignment(w)) assigning = 0;
+        else if (assigning || declaring) {
+            char *s = expand_whole(&ex, w);
+            if (s) add_field(&ex, s);
+            continue;
+        }
+        expand_word(&ex, w);
+    }
+    c->argv[ex.argc] = NULL;
+
+    for (int i = 0; i < st->nredirs && !ex.err; i++) {
+        const redir_t *r = &st->redirs[i];
+        char *target = expand_whole(&ex, r->target);
+        if (!target) break;
+        if (r->type == REDIR_DUP && (!isdigit((unsigned char)target[0]) || target[strspn(target, "0123456789")])) {
+            fprintf(stderr, "tsh: %s: ambiguous redirect\n", target);
+            ex.err = 1;
+            break;
+        }
+        c->redirs[c->nredirs].fd = r->fd;
+        c->redirs[c->nredirs].type = r->type;
+        c->redirs[c->nredirs].target = target;
+        c->nredirs++;
+    }
+
+    free(ex.lit);
+    free(ex.pat);
+    if (ex.err) {
+        free_commands(c, 1);
+        return -1;
+    }
+    return 0;
+}
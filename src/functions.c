@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "functions.h"
+
+typedef struct function {
+    char *name;
+    list_t *body;
+} function_t;
+
+// A variable shadowed by "local", restored when its frame is popped.
+typedef struct saved_var {
+    char *name;
+    char *value;    // NULL if it was unset
+} saved_var_t;
+
+// One per function call (or source with arguments): $1... and the locals
+// declared while it runs.
+typedef struct frame {
+    int argc;       // including $0
+    char **argv;
+    int is_function;
+    saved_var_t *saved;
+    int nsaved;
+} frame_t;
+
+#define MAX_FRAMES 1000
+
+static function_t *functions = NULL;
+static int nfunctions = 0, functions_cap = 0;
+static frame_t frames[MAX_FRAMES];
+static int nframes = 0;
+static int fdepth = 0;
+static int returning = 0;
+static int return_status = 0;
+
+static function_t *lookup(const char *name) {
+    for (int i = 0; i < nfunctions; i++) if (strcmp(functions[i].name, name) == 0) return &functions[i];
+    return NULL;
+}
+
+// The table takes its own reference to body.
+int function_define(const char *name, list_t *body) {
+    function_t *f = lookup(name);
+    if (f) {
+        list_t *old = f->body;
+        f->body = list_retain(body);
+        list_release(old);
+        return 0;
+    }
+    if (nfunctions == functions_cap) {
+        int cap = functions_cap ? functions_cap * 2 : 16;
+        function_t *grown = realloc(functions, sizeof(*functions) * cap);
+        if (!grown) return -1;
+        functions = grown;
+        functions_cap = cap;
+    }
+    char *copy = strdup(name);
+    if (!copy) return -1;
+    functions[nfunctions].name = copy;
+    functions[nfunctions].body = list_retain(body);
+    nfunctions++;
+    return 0;
+}
+
+list_t *function_find(const char *name) {
+    if (nfunctions == 0 || !name) return NULL;
+    function_t *f = lookup(name);
+    return f ? f->body : NULL;
+}
+
+int function_unset(const char *name) {
+    function_t *f = lookup(name);
+    if (!f) return -1;
+    free(f->name);
+    list_release(f->body);
+    *f = functions[--nfunctions];
+    return 0;
+}
+
+void free_functions(void) {
+    for (int i = 0; i < nfunctions; i++) {
+        free(functions[i].name);
+        list_release(functions[i].body);
+    }
+    free(functions);
+    functions = NULL;
+    nfunctions = functions_cap = 0;
+}
+
+// $0 carries over from the caller; argv[0] (the function name) is only
+// kept for the frame count. Fails only when every frame is in use.
+int params_push(int argc, char **argv, int is_function) {
+    if (nframes == MAX_FRAMES) return -1;
+    frame_t *f = &frames[nframes];
+    memset(f, 0, sizeof(*f));
+    f->argv = malloc(sizeof(char *) * (argc + 1));
+    if (f->argv) {
+        int outer_argc;
+        char **outer;
+        params_get(&outer_argc, &outer);
+        f->argv[0] = strdup(outer_argc > 0 ? outer[0] : "tsh");
+        for (int i = 1; i < argc; i++) f->argv[i] = strdup(argv[i]);
+        f->argv[argc] = NULL;
+        f->argc = argc;
+    }
+    f->is_function = is_function;
+    if (is_function) fdepth++;
+    nframes++;
+    return 0;
+}
+
+void params_pop(void) {
+    if (nframes == 0) return;
+    frame_t *f = &frames[--nframes];
+    // Restore in reverse, so a name declared local twice ends up as before.
+    for (int i = f->nsaved - 1; i >= 0; i--) {
+        saved_var_t *v = &f->saved[i];
+        if (v->value) setenv(v->name, v->value, 1);
+        else unsetenv(v->name);
+        free(v->name);
+        free(v->value);
+    }
+    free(f->saved);
+    for (int i = 0; i < f->argc; i++) free(f->argv[i]);
+    free(f->argv);
+    if (f->is_function) fdepth--;
+}
+
+void params_get(int *argc, char ***argv) {
+    if (nframes == 0) { *argc = 0; *argv = NULL; return; }
+    *argc = frames[nframes - 1].argc;
+    *argv = frames[nframes - 1].argv;
+}
+
+// shift [n]: drops $1..$n.
+int params_shift(int n) {
+    if (nframes == 0) return n == 0 ? 0 : -1;
+    frame_t *f = &frames[nframes - 1];
+    if (n < 0 || n > f->argc - 1) return -1;
+    for (int i = 1; i <= n; i++) free(f->argv[i]);
+    memmove(f->argv + 1, f->argv + 1 + n, sizeof(char *) * (f->argc - n));
+    f->argc -= n;
+    return 0;
+}
+
+int function_depth(void) {
+    return fdepth;
+}
+
+// local NAME[=value]: the old value comes back when the function returns.
+// Callees see the local, as in other shells with dynamic scoping.
+int local_declare(const char *assignment) {
+    frame_t *f = NULL;
+    for (int i = nframes - 1; i >= 0 && !f; i--) if (frames[i].is_function) f = &frames[i];
+    if (!f) return -1;
+
+    const char *eq = strchr(assignment, '=');
+    char *name = eq ? strndup(assignment, eq - assignment) : strdup(assignment);
+    if (!name) return -1;
+
+    int seen = 0;
+    for (int i = 0; i < f->nsaved; i++) if (strcmp(f->saved[i].name, name) == 0) seen = 1;
+    if (!seen) {
+        saved_var_t *grown = realloc(f->saved, sizeof(*f->saved) * (f->nsaved + 1));
+        if (!grown) { free(name); return -1; }
+        f->saved = grown;
+        const char *old = getenv(name);
+        f->saved[f->nsaved].name = name;
+        f->saved[f->nsaved].value = old ? strdup(old) : NULL;
+        f->nsaved++;
+    }
+
+    if (eq) setenv(seen ? name : f->saved[f->nsaved - 1].name, eq + 1, 1);
+    else if (!seen) unsetenv(name);
+    if (seen) free(name);
+    return 0;
+}
+
+// "return" unwinds the lists being run until the function call (or
+// source) that is waiting for it takes the status.
+void return_request(int status) {
+    returning = 1;
+    return_status = status;
+}
+
+int return_pending(void) {
+    return returning;
+}
+
+int return_take(void) {
+    returning = 0;
+    return return_status;
+}
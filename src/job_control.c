@@ -6,99 +6,410 @@
 #include <errno.h>
 #include <signal.h>
 #include "job_control.h"
+#include "trace.h"
+#include "builtins.h"
 
-static job_t jobs[MAX_JOBS];
+// Grown as needed and never shrunk; a job never moves once allocated, so
+// callers may hold on to a job_t * while the table grows.
+static job_t **jobs = NULL;
+static int njobs = 0;
 static int next_jid = 1;
 
+static int job_control = 0;
+static int shell_terminal = STDIN_FILENO;
+static pid_t shell_pgid;
+static struct termios shell_tmodes;
+static volatile sig_atomic_t interrupted = 0;
+
+// The table starts empty and is allocated by the first add_job.
 void init_jobs(void) {
-    memset(jobs, 0, sizeof(jobs));
     next_jid = 1;
 }
 
-int add_job(pid_t pgid, const char *cmdline) {
-    for (int i = 0; i < MAX_JOBS; ++i) {
-        if (jobs[i].pgid == 0) {
-            jobs[i].pgid = pgid;
-            jobs[i].jid = next_jid++;
-            jobs[i].cmdline = strdup(cmdline);
-            jobs[i].state = JOB_RUNNING;
-            return jobs[i].jid;
-        }
+// Interactive shells own the terminal: the shell runs in its own process
+// group and hands the terminal to whichever job is in the foreground, so
+// Ctrl-C/Ctrl-Z go from the kernel straight to that job.
+// ^C only reaches the shell itself while it waits for background jobs;
+// all it does is end that wait.
+static void sigint_wake(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+void init_job_control(void) {
+    // Wait until we are in the foreground before taking over.
+    while (tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp())) kill(-shell_pgid, SIGTTIN);
+
+    // A handler rather than SIG_IGN, so ^C can break a wait; exec puts
+    // it back to the default in children.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigint_wake;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid && setpgid(shell_pgid, shell_pgid) < 0) {
+        perror("tsh: setpgid");
+        return;
     }
-    return -1;
+    if (tcsetpgrp(shell_terminal, shell_pgid) < 0) { perror("tsh: tcsetpgrp"); return; }
+    tcgetattr(shell_terminal, &shell_tmodes);
+    job_control = 1;
+}
+
+int job_control_enabled(void) {
+    return job_control;
+}
+
+// Called by both the child and the parent after fork, whichever runs
+// first, so the job never reads the terminal before it owns it.
+void terminal_foreground(pid_t pgid) {
+    if (job_control) tcsetpgrp(shell_terminal, pgid);
+}
+
+// Puts a job in the foreground, restoring the modes it had when it stopped.
+void terminal_give(pid_t pgid, const job_t *j) {
+    if (!job_control) return;
+    if (j && j->has_tmodes) tcsetattr(shell_terminal, TCSADRAIN, &j->tmodes);
+    tcsetpgrp(shell_terminal, pgid);
+}
+
+// Takes the terminal back once the foreground job stops or exits. A stopped
+// job keeps its modes (e.g. an editor's raw mode) for the next fg.
+void terminal_reclaim(job_t *j) {
+    if (!job_control) return;
+    tcsetpgrp(shell_terminal, shell_pgid);
+    if (j && j->state == JOB_STOPPED) j->has_tmodes = (tcgetattr(shell_terminal, &j->tmodes) == 0);
+    tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+}
+
+// The SIGCHLD and SIGHUP handlers walk the table; it only changes size
+// with them blocked.
+static void block_table_signals(sigset_t *prev) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, prev);
+}
+
+// Doubles the table. Returns the first new slot, or NULL when out of memory.
+static job_t *grow_jobs(void) {
+    int n = njobs ? njobs * 2 : 16;
+    job_t **grown = malloc(sizeof(job_t *) * n);
+    if (!grown) return NULL;
+    int have = njobs;
+    while (have < n && (grown[have] = calloc(1, sizeof(job_t)))) have++;
+    if (have == njobs) { free(grown); return NULL; }
+    sigset_t prev;
+    block_table_signals(&prev);
+    if (njobs) memcpy(grown, jobs, sizeof(job_t *) * njobs);
+    job_t **old = jobs;
+    jobs = grown;
+    int first = njobs;
+    njobs = have;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    free(old);
+    return jobs[first];
+}
+
+int add_job(pid_t pgid, const pid_t *pids, int npids, const char *cmdline) {
+    if (npids > MAX_JOB_PROCS) return -1;
+    job_t *slot = NULL;
+    for (int i = 0; i < njobs && !slot; ++i) if (jobs[i]->pgid == 0) slot = jobs[i];
+    // Before growing, recycle finished jobs nobody has collected yet, so a
+    // script that never waits does not keep them all.
+    for (int i = 0; i < njobs && !slot; ++i) if (jobs[i]->state == JOB_DONE) { remove_job(jobs[i]); slot = jobs[i]; }
+    if (!slot) slot = grow_jobs();
+    if (!slot) return -1;
+
+    // Like other shells, hand out the lowest jid above every live job.
+    next_jid = 1;
+    for (int i = 0; i < njobs; ++i) if (jobs[i]->pgid != 0 && jobs[i]->jid >= next_jid) next_jid = jobs[i]->jid + 1;
+
+    slot->pgid = pgid;
+    slot->jid = next_jid++;
+    slot->cmdline = strdup(cmdline);
+    slot->state = JOB_RUNNING;
+    slot->foreground = 0;
+    slot->nprocs = npids;
+    slot->nlive = npids;
+    slot->has_tmodes = 0;
+    slot->trace = NULL;
+    slot->start_us = slot->spawn_us = slot->end_us = slot->cpu_us = 0;
+    for (int i = 0; i < npids; ++i) {
+        slot->pids[i] = pids[i];
+        slot->statuses[i] = -1;
+    }
+    return slot->jid;
 }
 
 job_t* find_job_by_jid(int jid) {
-    for (int i = 0; i < MAX_JOBS; ++i) if (jobs[i].pgid != 0 && jobs[i].jid == jid) return &jobs[i];
+    for (int i = 0; i < njobs; ++i) if (jobs[i]->pgid != 0 && jobs[i]->jid == jid) return jobs[i];
     return NULL;
 }
 
 job_t* find_job_by_pgid(pid_t pgid) {
-    for (int i = 0; i < MAX_JOBS; ++i) if (jobs[i].pgid == pgid) return &jobs[i];
+    for (int i = 0; i < njobs; ++i) if (jobs[i]->pgid == pgid) return jobs[i];
     return NULL;
 }
 
+job_t* find_job_by_pid(pid_t pid, int *stage) {
+    for (int i = 0; i < njobs; ++i) {
+        if (jobs[i]->pgid == 0) continue;
+        for (int k = 0; k < jobs[i]->nprocs; ++k) {
+            if (jobs[i]->pids[k] == pid) {
+                if (stage) *stage = k;
+                return jobs[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+static void emit_job_trace(job_t *j) {
+    if (!j->trace) return;
+    trace_pipeline(j->trace, j->pgid, j->jid, j->start_us, j->spawn_us, j->end_us, j->cpu_us, job_exit_status(j));
+    free(j->trace);
+    j->trace = NULL;
+}
+
 void remove_job(job_t *j) {
     if (!j) return;
+    if (j->state == JOB_DONE) emit_job_trace(j);
+    free(j->trace);
+    j->trace = NULL;
     if (j->cmdline) free(j->cmdline);
     j->cmdline = NULL;
     j->pgid = 0;
     j->jid = 0;
+    j->nprocs = 0;
 }
 
+// Finished jobs are listed once and then forgotten, as in other shells.
 void print_jobs(void) {
-    for (int i = 0; i < MAX_JOBS; ++i) {
-        if (jobs[i].pgid != 0) {
+    for (int i = 0; i < njobs; ++i) {
+        if (jobs[i]->pgid != 0) {
             const char *state_str = "Unknown";
-            switch (jobs[i].state) {
+            switch (jobs[i]->state) {
                 case JOB_RUNNING: state_str = "Running"; break;
                 case JOB_STOPPED: state_str = "Stopped"; break;
                 case JOB_DONE:    state_str = "Done";    break;
             }
-            printf("[%d] %s   %s\n", jobs[i].jid, state_str, jobs[i].cmdline);
+            printf("[%d] %s   %s\n", jobs[i]->jid, state_str, jobs[i]->cmdline);
+            if (jobs[i]->state == JOB_DONE) remove_job(jobs[i]);
         }
     }
 }
 
+int status_to_exit(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return 0;
+}
+
+// A pipeline's status is that of its last stage or, with pipefail, of the
+// last stage that failed. codes are the stages' exit statuses in order.
+int pipeline_status(const int *codes, int n) {
+    if (shell_option(OPT_PIPEFAIL)) {
+        for (int i = n - 1; i >= 0; i--) if (codes[i] != 0) return codes[i];
+    }
+    return n > 0 ? codes[n - 1] : 0;
+}
+
+int job_exit_status(const job_t *j) {
+    if (j->state == JOB_STOPPED) return 128 + j->stop_sig;
+    int codes[MAX_JOB_PROCS];
+    for (int i = 0; i < j->nprocs; i++) codes[i] = j->statuses[i] < 0 ? 0 : status_to_exit(j->statuses[i]);
+    return pipeline_status(codes, j->nprocs);
+}
+
+// Records a state change reported by wait4. Called from the SIGCHLD
+// handler, or with SIGCHLD blocked, so job state is never torn.
+void job_update(pid_t pid, int status, const struct rusage *ru) {
+    int stage;
+    job_t *j = find_job_by_pid(pid, &stage);
+    if (!j) return;
+
+    char buf[512];
+    int n = 0;
+    if (WIFSTOPPED(status)) {
+        // Each stage reports its own stop; announce the job only once.
+        if (j->state == JOB_STOPPED) return;
+        j->state = JOB_STOPPED;
+        j->stop_sig = WSTOPSIG(status);
+        if (!j->foreground) n = snprintf(buf, sizeof(buf), "\n[%d] Stopped   %s\n", j->jid, j->cmdline);
+    } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        if (j->statuses[stage] < 0) j->nlive--;
+        j->statuses[stage] = status;
+        if (ru) {
+            j->cpu_us += ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec
+                       + ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+        }
+        if (j->nlive == 0) {
+            j->state = JOB_DONE;
+            j->end_us = trace_now_us();
+            if (!j->foreground) n = snprintf(buf, sizeof(buf), "\n[%d] Done   %s\n", j->jid, j->cmdline);
+        }
+    }
+    if (n > 0) {
+        if (n > (int)sizeof(buf)) n = sizeof(buf);
+        ssize_t w = write(STDOUT_FILENO, buf, n);
+        (void)w;
+    }
+}
+
 void sigchld_handler(int sig) {
     (void)sig;
     int saved_errno = errno;
     pid_t pid;
     int status;
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-        job_t *j = find_job_by_pgid(pid);
-        if (!j) {
-            for (int i = 0; i < MAX_JOBS; ++i) {
-                if (jobs[i].pgid != 0) {
-                    if (kill(-jobs[i].pgid, 0) == -1 && errno == ESRCH) {
-                        j = &jobs[i];
-                        break;
-                    }
-                }
-            }
-        }
-        if (j) {
-            if (WIFSTOPPED(status)) {
-                j->state = JOB_STOPPED;
-                char buf[512];
-                int n = snprintf(buf, sizeof(buf), "\n[%d] Stopped   %s\n", j->jid, j->cmdline);
-                if (n > 0) write(STDOUT_FILENO, buf, n);
-            } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                j->state = JOB_DONE;
-                char buf[512];
-                int n = snprintf(buf, sizeof(buf), "\n[%d] Done   %s\n", j->jid, j->cmdline);
-                if (n > 0) write(STDOUT_FILENO, buf, n);
+    struct rusage ru;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED, &ru)) > 0) {
+        job_update(pid, status, &ru);
+    }
+    errno = saved_errno;
+}
+
+// The waiters below sleep in sigsuspend and are woken by the SIGCHLD
+// handler, which reaps children and updates the table; nothing is polled.
+// ^C in an interactive shell ends the wait early with status 130.
+static void block_sigchld(sigset_t *prev, sigset_t *suspend) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, prev);
+    *suspend = *prev;
+    sigdelset(suspend, SIGCHLD);
+}
+
+// Continues a stopped or running job, giving it the terminal first when it
+// goes to the foreground. A job that has already finished gets no SIGCONT
+// and no SIGCHLD will come for it: returns -1 so the caller collects it.
+int job_continue(job_t *j, int foreground) {
+    sigset_t prev, suspend;
+    block_sigchld(&prev, &suspend);
+    int done = j->state == JOB_DONE;
+    if (!done) {
+        j->state = JOB_RUNNING;
+        j->foreground = foreground;
+        if (foreground) terminal_give(j->pgid, j);
+        kill(-j->pgid, SIGCONT);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return done ? -1 : 0;
+}
+
+int wait_for_job(job_t *j) {
+    sigset_t prev, suspend;
+    block_sigchld(&prev, &suspend);
+    interrupted = 0;
+    while (j->state == JOB_RUNNING && !interrupted) sigsuspend(&suspend);
+    int status = j->state == JOB_RUNNING ? 130 : job_exit_status(j);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return status;
+}
+
+int wait_for_pid(pid_t pid) {
+    sigset_t prev, suspend;
+    block_sigchld(&prev, &suspend);
+    int stage;
+    job_t *j = find_job_by_pid(pid, &stage);
+    int status = 127;
+    if (j) {
+        interrupted = 0;
+        while (j->state == JOB_RUNNING && j->statuses[stage] < 0 && !interrupted) sigsuspend(&suspend);
+        if (j->statuses[stage] >= 0) status = status_to_exit(j->statuses[stage]);
+        else status = j->state == JOB_RUNNING ? 130 : job_exit_status(j);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return status;
+}
+
+// Returns the finished job that has not been collected yet and finished
+// first, waiting for one if necessary. Only the nonly jobs in only count,
+// or every job when nonly is 0. NULL means none of them could still finish,
+// or the wait was interrupted (see wait_interrupted).
+job_t* wait_any_job(job_t *const *only, int nonly) {
+    sigset_t prev, suspend;
+    block_sigchld(&prev, &suspend);
+    interrupted = 0;
+    job_t *done = NULL;
+    while (!done) {
+        int running = 0;
+        int n = nonly ? nonly : njobs;
+        for (int i = 0; i < n; ++i) {
+            job_t *j = nonly ? only[i] : jobs[i];
+            if (j->pgid == 0) continue;
+            if (j->state == JOB_DONE) {
+                if (!done || j->end_us < done->end_us) done = j;
+            } else if (j->state == JOB_RUNNING) {
+                running = 1;
             }
         }
+        if (done || !running || interrupted) break;
+        sigsuspend(&suspend);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return done;
+}
+
+// The last wait_any_job gave up because of ^C.
+int wait_interrupted(void) {
+    return interrupted;
+}
+
+// Background jobs are traced when they finish; this writes out the ones
+// nobody has collected with wait/fg/jobs yet.
+void trace_done_jobs(void) {
+    if (!trace_enabled()) return;
+    sigset_t mask, prev;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    for (int i = 0; i < njobs; ++i) {
+        if (jobs[i]->pgid != 0 && jobs[i]->state == JOB_DONE) emit_job_trace(jobs[i]);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+// Passes a hangup on to every job that is still around, stopped ones
+// included. Only calls kill(), so it is safe from a signal handler.
+void hangup_jobs(void) {
+    for (int i = 0; i < njobs; ++i) {
+        if (jobs[i]->pgid == 0 || jobs[i]->state == JOB_DONE) continue;
+        kill(-jobs[i]->pgid, SIGHUP);
+        if (jobs[i]->state == JOB_STOPPED) kill(-jobs[i]->pgid, SIGCONT);
     }
-    errno = saved_errno;
 }
 
 void free_jobs(void) {
-    for (int i = 0; i < MAX_JOBS; ++i) {
-        if (jobs[i].pgid != 0) {
-            free(jobs[i].cmdline);
-            jobs[i].cmdline = NULL;
-        }
+    sigset_t prev;
+    block_table_signals(&prev);
+    job_t **old = jobs;
+    int n = njobs;
+    jobs = NULL;
+    njobs = 0;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    for (int i = 0; i < n; ++i) {
+        free(old[i]->cmdline);
+        free(old[i]->trace);
+        free(old[i]);
     }
+    free(old);
+}
+
+// For a forked copy of the shell that runs a group or function as one
+// pipeline stage: the jobs and the terminal still belong to the parent.
+void job_control_subshell(void) {
+    free_jobs();
+    next_jid = 1;
+    job_control = 0;
 }
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -10,7 +11,13 @@
 #include "job_control.h"
 #include "builtins.h"
 #include "readline.h"
-#include <ctype.h>
+#include "profile.h"
+#include "resources.h"
+#include "trace.h"
+#include "expand.h"
+#include "run.h"
+#include "server.h"
+#include "functions.h"
 
 static volatile pid_t fg_pgid = 0;
 static int last_exit_status = 0;
@@ -29,27 +36,179 @@ void sigtstp_handler(int sig) {
     }
 }
 
-static void execute_pipeline(command_t cmds[], int ncmds, int background, char *origline) {
+// Like other shells, take every job down with us when the session goes away.
+void sighup_handler(int sig) {
+    if (fg_pgid > 0) kill(-fg_pgid, SIGHUP);
+    hangup_jobs();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static pid_t last_bg_pid = 0;
+static int exec_in_place = 0;      // set in disposable server workers
+static int subshell = 0;           // a forked stage running a group or function
+static char *pending = NULL;       // lines of a command that is not complete yet
+
+static void exec_list(list_t *l, int top);
+
+// Applies a stage's redirections in order, so "2>&1 >f" and ">f 2>&1"
+// differ as they do in other shells. Runs in the child after fork.
+static int apply_redirs(const command_t *c) {
+    for (int i = 0; i < c->nredirs; i++) {
+        const redir_t *r = &c->redirs[i];
+        int fd = -1;
+        switch (r->type) {
+            case REDIR_IN:     fd = open(r->target, O_RDONLY); break;
+            case REDIR_OUT:    fd = open(r->target, O_WRONLY | O_CREAT | O_TRUNC, 0644); break;
+            case REDIR_APPEND: fd = open(r->target, O_WRONLY | O_CREAT | O_APPEND, 0644); break;
+            case REDIR_DUP:
+                if (dup2(atoi(r->target), r->fd) < 0) {
+                    fprintf(stderr, "tsh: %s: %s\n", r->target, strerror(errno));
+                    return -1;
+                }
+                continue;
+            case REDIR_CLOSE:
+                close(r->fd);
+                continue;
+        }
+        if (fd < 0) { fprintf(stderr, "tsh: %s: %s\n", r->target, strerror(errno)); return -1; }
+        if (fd != r->fd) {
+            if (dup2(fd, r->fd) < 0) { perror("dup2"); close(fd); return -1; }
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+static void install_sigchld(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+static int call_function(command_t *c);
+
+// A group or function used as a pipeline stage, or in the background,
+// runs in the forked child as a copy of the shell. Its own pipelines stay
+// in the stage's process group, and the jobs and terminal stay with the
+// parent.
+static int run_subshell(command_t *c) {
+    subshell = 1;
+    exec_in_place = 1;
+    job_control_subshell();
+    install_sigchld();
+    int status;
+    if (c->group) {
+        exec_list(c->group, 1);
+        status = return_pending() ? return_take() : last_exit_status;
+    } else {
+        status = call_function(c);
+    }
+    fflush(stdout);
+    return status;
+}
+
+// Variables the shell sets for itself. They expand like the others, which
+// live in the environment, but are not passed on to the commands it runs.
+static struct {
+    const char *name;
+    char value[MAX_CMDS * 4 + 1];
+} shell_vars[] = { { "PIPESTATUS", "" }, { "COPROC", "" }, { "COPROC_PID", "" } };
+
+static char *shell_var_buf(const char *name, size_t *size) {
+    for (size_t i = 0; i < sizeof(shell_vars) / sizeof(shell_vars[0]); i++) {
+        if (strcmp(shell_vars[i].name, name) == 0) {
+            *size = sizeof(shell_vars[i].value);
+            return shell_vars[i].value;
+        }
+    }
+    return NULL;
+}
+
+// Unset until first assigned, so an inherited value still shows through.
+static const char *shell_var(const char *name) {
+    size_t size;
+    const char *v = shell_var_buf(name, &size);
+    return v && *v ? v : NULL;
+}
+
+// PIPESTATUS: the exit status of each stage of the last foreground
+// pipeline, as an array (space separated, like COPROC).
+static void set_pipestatus(const int *codes, int n) {
+    size_t size;
+    char *buf = shell_var_buf("PIPESTATUS", &size);
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < n; i++) len += snprintf(buf + len, size - len, i ? " %d" : "%d", codes[i]);
+}
+
+// A foreground job was stopped (Ctrl-Z): it goes into the job table, with
+// the statuses of stages that already exited and its pending trace record.
+static job_t *stop_foreground(pid_t pgid, const pid_t *pids, int started, const int *stage_status,
+                              int stop_sig, const char *origline, char **trace_desc, long long t_start,
+                              long long spawn_us, long long cpu_us) {
+    printf("\n");
+    int jid = add_job(pgid, pids, started, origline);
+    job_t *j = find_job_by_jid(jid);
+    if (!j) return NULL;
+    for (int k=0;k<started;k++) if (stage_status[k] >= 0) job_update(pids[k], stage_status[k], NULL);
+    j->state = JOB_STOPPED;
+    j->stop_sig = stop_sig;
+    j->trace = *trace_desc;
+    j->start_us = t_start;
+    j->spawn_us = spawn_us;
+    j->cpu_us = cpu_us;
+    *trace_desc = NULL;
+    printf("[%d] Stopped   %s\n", jid, origline);
+    return j;
+}
+
+// in_fd/out_fd, when not -1, become stdin of the first stage and stdout of
+// the last one (used by coproc).
+static void execute_pipeline(command_t cmds[], int ncmds, int background, const char *origline, int in_fd, int out_fd) {
     sigset_t mask, prev_mask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGCHLD);
     sigprocmask(SIG_BLOCK, &mask, &prev_mask);
 
+    fflush(stdout); // keep our own output ordered before the children's
+
+    long long t_start = trace_enabled() ? trace_now_us() : 0;
+
     int pipes[2*(MAX_CMDS)];
-    for (int i=0;i<ncmds-1;i++) if (pipe(pipes + i*2) < 0) { perror("pipe"); sigprocmask(SIG_SETMASK, &prev_mask, NULL); return; }
+    for (int i=0;i<ncmds-1;i++) if (pipe(pipes + i*2) < 0) { perror("pipe"); for (int j=0;j<2*i;j++) close(pipes[j]); sigprocmask(SIG_SETMASK, &prev_mask, NULL); return; }
 
-    pid_t pgid = 0;
+    // Inside a subshell every child stays in the group of the job we belong to.
+    pid_t pgid = subshell ? getpgrp() : 0;
+    pid_t pids[MAX_CMDS];
+    int started = 0;
 
     for (int i=0;i<ncmds;i++) {
         pid_t pid = fork();
-        if (pid < 0) { perror("fork"); return; }
+        if (pid < 0) { perror("fork"); break; }
         if (pid == 0) {
+            trace_forget();
+            if (pgid == 0) pgid = getpid();
+            setpgid(0, pgid);
+            // Before SIGTTOU goes back to default, or this would stop us.
+            if (!background) terminal_foreground(pgid);
+
             signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
             signal(SIGCHLD, SIG_DFL);
             sigprocmask(SIG_SETMASK, &prev_mask, NULL); // Unblock signals in child
-            if (pgid == 0) pgid = getpid();
-            setpgid(0, pgid);
 
+            if (i == 0 && in_fd >= 0) {
+                if (dup2(in_fd, STDIN_FILENO) < 0) { perror("dup2"); _exit(1); }
+            }
+            if (i == ncmds-1 && out_fd >= 0) {
+                if (dup2(out_fd, STDOUT_FILENO) < 0) { perror("dup2"); _exit(1); }
+            }
             if (i > 0) {
                 if (dup2(pipes[(i-1)*2], STDIN_FILENO) < 0) { perror("dup2"); _exit(1); }
             }
@@ -59,169 +218,622 @@ static void execute_pipeline(command_t cmds[], int ncmds, int background, char *
 
             for (int j=0;j<2*(ncmds-1);j++) close(pipes[j]);
 
-            if (cmds[i].infile) {
-                int fd = open(cmds[i].infile, O_RDONLY);
-                if (fd < 0) { perror("tsh: input redir"); _exit(1); }
-                dup2(fd, STDIN_FILENO); close(fd);
-            }
-            if (cmds[i].outfile) {
-                int flags = O_WRONLY | O_CREAT | (cmds[i].append ? O_APPEND : O_TRUNC);
-                int fd = open(cmds[i].outfile, flags, 0644);
-                if (fd < 0) { perror("tsh: output redir"); _exit(1); }
-                dup2(fd, STDOUT_FILENO); close(fd);
+            if (apply_redirs(&cmds[i]) < 0) _exit(1);
+
+            if (cmds[i].group || function_find(cmds[i].argv[0])) _exit(run_subshell(&cmds[i]));
+            if (!cmds[i].argv[0]) _exit(0);
+
+            // A builtin in a stage runs here, as it would in a subshell:
+            // exit leaves the stage, wait and fg see no jobs.
+            const builtin_t *b = find_builtin(&cmds[i]);
+            if (b) {
+                job_control_subshell();
+                int status = b->fn(&cmds[i]);
+                fflush(stdout);
+                _exit(status);
             }
 
-            execvp(cmds[i].argv[0], cmds[i].argv);
-            fprintf(stderr, "tsh: %s: %s\n", cmds[i].argv[0], strerror(errno));
+            char **argv = cmds[i].argv;
+            if (apply_stage_prefixes(&argv) < 0) _exit(1);
+
+            execvp(argv[0], argv);
+            fprintf(stderr, "tsh: %s: %s\n", argv[0], strerror(errno));
             _exit(127);
         }
         if (pgid == 0) pgid = pid;
         setpgid(pid, pgid);
+        pids[started++] = pid;
+        if (!background && i == 0) terminal_give(pgid, NULL);
     }
 
     for (int j=0;j<2*(ncmds-1);j++) close(pipes[j]);
 
+    if (started == 0) {
+        last_exit_status = 1;
+        sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+        return;
+    }
+
+    char *trace_desc = NULL;
+    long long t_spawned = 0;
+    if (trace_enabled()) {
+        t_spawned = trace_now_us();
+        trace_desc = trace_describe(cmds, ncmds, origline, pids, started);
+    }
+
     if (background) {
-        int jid = add_job(pgid, origline);
+        int jid = add_job(pgid, pids, started, origline);
         if (jid < 0) fprintf(stderr, "tsh: cannot add job\n");
         else printf("[%d] %d\n", jid, pgid);
+        job_t *j = jid < 0 ? NULL : find_job_by_jid(jid);
+        if (j) {
+            j->trace = trace_desc;
+            j->start_us = t_start;
+            j->spawn_us = t_spawned - t_start;
+        } else {
+            free(trace_desc);
+        }
+        last_bg_pid = pids[started-1];
         sigprocmask(SIG_SETMASK, &prev_mask, NULL); // Unblock
     } else {
-        fg_pgid = pgid;
+        if (!subshell) fg_pgid = pgid;
         int status;
+        int stage_status[MAX_CMDS];
+        for (int k=0;k<started;k++) stage_status[k] = -1;
+        int live = started;
+        int stop_sig = 0;
+        pid_t pid;
+        struct rusage ru;
+        long long cpu_us = 0;
+        job_t *stopped = NULL;
         
-        // SIGCHLD is blocked, so waitpid will see the changes, preventing race with handler
-        while (waitpid(-pgid, &status, WUNTRACED) > 0) {
+        // SIGCHLD is blocked, so wait4 will see the changes, preventing race with handler
+        while (live > 0 && (pid = wait4(-1, &status, WUNTRACED, &ru)) > 0) {
+            int k = 0;
+            while (k < started && pids[k] != pid) k++;
+            // A background job that changed meanwhile is recorded as it goes.
+            if (k == started) { job_update(pid, status, &ru); continue; }
             if (WIFSTOPPED(status)) {
-                printf("\n");
-                int jid = add_job(pgid, origline);
-                job_t *j = find_job_by_jid(jid);
-                if (j) {
-                    j->state = JOB_STOPPED;
-                    printf("[%d] Stopped   %s\n", jid, origline);
-                }
+                stop_sig = WSTOPSIG(status);
+                stopped = stop_foreground(pgid, pids, started, stage_status, stop_sig, origline, &trace_desc,
+                                          t_start, t_spawned - t_start, cpu_us);
                 break;
             }
-            if (WIFEXITED(status)) {
-                last_exit_status = WEXITSTATUS(status);
-            } else if (WIFSIGNALED(status)) {
-                last_exit_status = 128 + WTERMSIG(status);
-            }
+            stage_status[k] = status;
+            live--;
+            cpu_us += ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec
+                    + ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+        }
+        // $? comes from the stages in order, not from whichever was reaped last.
+        if (stop_sig) {
+            last_exit_status = 128 + stop_sig;
+        } else {
+            int codes[MAX_CMDS];
+            for (int k=0;k<started;k++) codes[k] = stage_status[k] < 0 ? 0 : status_to_exit(stage_status[k]);
+            last_exit_status = pipeline_status(codes, started);
+            set_pipestatus(codes, started);
+        }
+        terminal_reclaim(stopped);
+        if (trace_desc) {
+            trace_pipeline(trace_desc, pgid, 0, t_start, t_spawned - t_start, trace_now_us(), cpu_us, last_exit_status);
+            free(trace_desc);
         }
         fg_pgid = 0;
         sigprocmask(SIG_SETMASK, &prev_mask, NULL); // Unblock
     }
 }
 
-static char* expand_variables(char *input) {
-    static char buf[MAX_LINE];
-    char *p = input;
-    char *q = buf;
-    while (*p && (q - buf < MAX_LINE - 100)) { // Safety margin
-        if (*p == '$') {
-            p++; // skip '$'
-            if (*p == '?') {
-                p++;
-                q += sprintf(q, "%d", last_exit_status);
-            } else if (isalpha((unsigned char)*p) || *p == '_') {
-                char varname[256];
-                int v = 0;
-                while (*p && (isalnum((unsigned char)*p) || *p == '_') && v < 255) {
-                    varname[v++] = *p++;
-                }
-                varname[v] = '\0';
-                char *val = getenv(varname);
-                if (val) {
-                    // Copy value ensuring no overflow
-                    while (*val && (q - buf < MAX_LINE - 1)) *q++ = *val++;
-                }
-            } else {
-                *q++ = '$'; // Not a var, keep $
-            }
+// The common case, one external command in the foreground with no
+// redirections or stage prefixes, skips the pipeline machinery. vfork
+// shares our memory until the exec, so there is no page table to copy, and
+// the child only makes syscalls on its own stack frame. All signals stay
+// blocked in the child until it is ready to exec; a handler that still
+// runs in it before the exec is harmless there (fg_pgid is 0 and it has no
+// children). The parent then needs a single wait4.
+static void run_simple(command_t *c, const char *origline) {
+    sigset_t all, prev, chld;
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &prev);
+    fflush(stdout);
+    long long t_start = trace_enabled() ? trace_now_us() : 0;
+
+    pid_t pid = vfork();
+    if (pid == 0) {
+        if (!subshell) setpgid(0, 0);
+        if (job_control_enabled()) {
+            terminal_foreground(getpid());
+            // Ignored signals would stay ignored across exec.
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+        }
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        execvp(c->argv[0], c->argv);
+        char msg[512];
+        int n = snprintf(msg, sizeof(msg), "tsh: %s: %s\n", c->argv[0], strerror(errno));
+        if (n > (int)sizeof(msg)) n = sizeof(msg);
+        ssize_t w = write(STDERR_FILENO, msg, n);
+        (void)w;
+        _exit(127);
+    }
+
+    // Back to blocking only SIGCHLD, so the handler cannot reap the child
+    // before wait4 does.
+    chld = prev;
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_SETMASK, &chld, NULL);
+    if (pid < 0) {
+        perror("tsh: fork");
+        last_exit_status = 1;
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        return;
+    }
+
+    char *trace_desc = NULL;
+    long long t_spawned = 0;
+    if (trace_enabled()) {
+        t_spawned = trace_now_us();
+        trace_desc = trace_describe(c, 1, origline, &pid, 1);
+    }
+
+    if (!subshell) fg_pgid = pid;
+    int status;
+    struct rusage ru;
+    pid_t r;
+    // Background jobs that finish meanwhile are recorded as they go, so
+    // wait -n sees them in the order they really finished.
+    while ((r = wait4(-1, &status, WUNTRACED, &ru)) != pid) {
+        if (r > 0) job_update(r, status, &ru);
+        else if (errno != EINTR) break;
+    }
+    long long cpu_us = 0;
+    job_t *stopped = NULL;
+    if (r < 0) {
+        last_exit_status = 1;
+    } else if (WIFSTOPPED(status)) {
+        int none = -1;
+        stopped = stop_foreground(subshell ? getpgrp() : pid, &pid, 1, &none, WSTOPSIG(status), origline,
+                                  &trace_desc, t_start, t_spawned - t_start, 0);
+        last_exit_status = 128 + WSTOPSIG(status);
+    } else {
+        last_exit_status = status_to_exit(status);
+        set_pipestatus(&last_exit_status, 1);
+        cpu_us = ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec
+               + ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+    }
+    terminal_reclaim(stopped);
+    if (trace_desc) {
+        trace_pipeline(trace_desc, pid, 0, t_start, t_spawned - t_start, trace_now_us(), cpu_us, last_exit_status);
+        free(trace_desc);
+    }
+    fg_pgid = 0;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+// Builtins, groups and function calls run in the shell itself, so their
+// redirections are applied around the call and undone afterwards, unless
+// keep is set (exec).
+static int run_with_redirs(command_t *c, int (*fn)(command_t *), int keep) {
+    if (c->nredirs == 0) return fn(c);
+
+    fflush(stdout);
+    if (keep) {
+        if (apply_redirs(c) < 0) return 1;
+        return fn(c);
+    }
+
+    // saved[i] holds what redirs[i].fd pointed at before, -1 if it was closed.
+    int saved[MAX_REDIRS];
+    int status = 1;
+    int n;
+    for (n = 0; n < c->nredirs; n++) {
+        saved[n] = fcntl(c->redirs[n].fd, F_DUPFD_CLOEXEC, 10);
+        if (saved[n] < 0 && errno != EBADF) { perror("tsh: dup"); break; }
+    }
+    if (n == c->nredirs && apply_redirs(c) == 0) {
+        status = fn(c);
+        fflush(stdout);
+        fflush(stderr);
+    }
+    // Undo in reverse, so an fd redirected twice ends up as it started.
+    while (n-- > 0) {
+        if (saved[n] < 0) close(c->redirs[n].fd);
+        else { dup2(saved[n], c->redirs[n].fd); close(saved[n]); }
+    }
+    return status;
+}
+
+// In a process that exits after this line anyway, a lone foreground
+// command can replace it instead of forking once more, as "sh -c" does.
+static void exec_simple(command_t *c) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    fflush(stdout);
+
+    if (apply_redirs(c) < 0) _exit(1);
+
+    char **argv = c->argv;
+    if (apply_stage_prefixes(&argv) < 0) _exit(1);
+
+    execvp(argv[0], argv);
+    fprintf(stderr, "tsh: %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+}
+
+// coproc cmd...: runs the pipeline in the background with its stdin and
+// stdout connected to the shell. ${COPROC[0]} reads from it, ${COPROC[1]}
+// writes to it, $COPROC_PID is its pid.
+static void start_coproc(command_t cmds[], int ncmds, const char *origline) {
+    static int co_fds[2] = { -1, -1 };
+    int to_co[2], from_co[2];
+
+    if (pipe(to_co) < 0) { perror("tsh: coproc"); last_exit_status = 1; return; }
+    if (pipe(from_co) < 0) { perror("tsh: coproc"); close(to_co[0]); close(to_co[1]); last_exit_status = 1; return; }
+    // The shell's ends must not leak into later children, or the
+    // coprocess would never see EOF.
+    fcntl(to_co[1], F_SETFD, FD_CLOEXEC);
+    fcntl(from_co[0], F_SETFD, FD_CLOEXEC);
+
+    if (co_fds[0] >= 0) close(co_fds[0]);
+    if (co_fds[1] >= 0) close(co_fds[1]);
+    co_fds[0] = from_co[0];
+    co_fds[1] = to_co[1];
+
+    // The stages get their ends through dup2; the originals close on exec.
+    fcntl(to_co[0], F_SETFD, FD_CLOEXEC);
+    fcntl(from_co[1], F_SETFD, FD_CLOEXEC);
+    execute_pipeline(cmds, ncmds, 1, origline, to_co[0], from_co[1]);
+    close(to_co[0]);
+    close(from_co[1]);
+
+    size_t size;
+    char *val = shell_var_buf("COPROC", &size);
+    snprintf(val, size, "%d %d", co_fds[0], co_fds[1]);
+    val = shell_var_buf("COPROC_PID", &size);
+    snprintf(val, size, "%d", (int)last_bg_pid);
+    last_exit_status = 0;
+}
+
+// set -x: echo each stage's expanded words to stderr before running it.
+static void xtrace(command_t cmds[], int ncmds) {
+    for (int i = 0; i < ncmds; i++) {
+        if (!cmds[i].argv[0]) continue;
+        fputs("+", stderr);
+        for (int j = 0; cmds[i].argv[j]; j++) {
+            const char *a = cmds[i].argv[j];
+            if (*a && !strpbrk(a, " \t\n'\"\\$|&<>*?;")) fprintf(stderr, " %s", a);
+            else fprintf(stderr, " '%s'", a);
+        }
+        fputs("\n", stderr);
+    }
+}
+
+#define MAX_FUNC_DEPTH 1000
+
+// Runs the stored body with the call's arguments as $1...; nothing is
+// parsed again. The body is held for the call, so the function may
+// redefine or unset itself.
+static int call_function(command_t *c) {
+    if (function_depth() >= MAX_FUNC_DEPTH) {
+        fprintf(stderr, "tsh: %s: maximum function nesting level exceeded\n", c->argv[0]);
+        return 1;
+    }
+    int argc = 0;
+    while (c->argv[argc]) argc++;
+    if (params_push(argc, c->argv, 1) < 0) {
+        fprintf(stderr, "tsh: %s: maximum function nesting level exceeded\n", c->argv[0]);
+        return 1;
+    }
+    list_t *body = list_retain(function_find(c->argv[0]));
+    exec_list(body, 0);
+    int status = return_pending() ? return_take() : last_exit_status;
+    params_pop();
+    list_release(body);
+    return status;
+}
+
+static int run_group(command_t *c) {
+    exec_list(c->group, 0);
+    return last_exit_status;
+}
+
+// NAME=value ... with no command sets the variables in the shell.
+static int assign_variables(command_t *c) {
+    for (int i = 0; c->argv[i]; i++) {
+        char *eq = strchr(c->argv[i], '=');
+        *eq = '\0';
+        setenv(c->argv[i], eq + 1, 1);
+    }
+    return 0;
+}
+
+static int no_command(command_t *c) {
+    (void)c;
+    return 0;
+}
+
+static int all_assignments(const stage_t *st) {
+    if (st->nwords == 0) return 0;
+    for (int i = 0; i < st->nwords; i++) if (!is_assignment(st->words[i])) return 0;
+    return 1;
+}
+
+// last: nothing runs after this pipeline, so a server worker may exec it.
+static void exec_pipeline(pipeline_t *p, int last) {
+    if (p->stages[0].funcname) {
+        if (function_define(p->stages[0].funcname, p->stages[0].group) < 0) {
+            fprintf(stderr, "tsh: %s: cannot define function\n", p->stages[0].funcname);
+            last_exit_status = 1;
+            return;
+        }
+        last_exit_status = 0;
+        return;
+    }
+
+    command_t *cmds = malloc(sizeof(command_t) * p->nstages);
+    if (!cmds) { perror("tsh"); last_exit_status = 1; return; }
+    expand_ctx_t ctx = { last_exit_status, last_bg_pid, 0, NULL, shell_var };
+    params_get(&ctx.argc, &ctx.argv);
+    int ncmds;
+    for (ncmds = 0; ncmds < p->nstages; ncmds++) {
+        if (expand_command(&p->stages[ncmds], &ctx, &cmds[ncmds]) < 0) break;
+    }
+    if (ncmds < p->nstages) {
+        free_commands(cmds, ncmds);
+        free(cmds);
+        last_exit_status = 1;
+        return;
+    }
+
+    const char *text = p->text ? p->text : "";
+    char *cmdline = NULL;
+    if (p->background && (cmdline = malloc(strlen(text) + 3))) sprintf(cmdline, "%s &", text);
+    const char *origline = cmdline ? cmdline : text;
+
+    if (shell_option(OPT_XTRACE)) xtrace(cmds, ncmds);
+
+    command_t *c = &cmds[0];
+    if (c->argv[0] && strcmp(c->argv[0], "coproc") == 0) {
+        if (!c->argv[1]) { fprintf(stderr, "tsh: coproc: expected command\n"); last_exit_status = 2; }
+        else {
+            memmove(c->argv, c->argv + 1, sizeof(char*) * (MAX_ARGS - 1));
+            start_coproc(cmds, ncmds, origline);
+        }
+    } else if (ncmds > 1 || p->background) {
+        execute_pipeline(cmds, ncmds, p->background, origline, -1, -1);
+    } else if (c->group) {
+        last_exit_status = run_with_redirs(c, run_group, 0);
+    } else if (all_assignments(&p->stages[0])) {
+        last_exit_status = run_with_redirs(c, assign_variables, 0);
+        set_pipestatus(&last_exit_status, 1);
+    } else if (!c->argv[0]) {
+        last_exit_status = run_with_redirs(c, no_command, 0);
+        set_pipestatus(&last_exit_status, 1);
+    } else if (function_find(c->argv[0])) {
+        last_exit_status = run_with_redirs(c, call_function, 0);
+    } else if (is_builtin(c)) {
+        const builtin_t *b = find_builtin(c);
+        if (trace_enabled()) {
+            char *desc = trace_describe(cmds, 1, origline, NULL, 0);
+            long long t0 = trace_now_us();
+            last_exit_status = run_with_redirs(c, b->fn, b->flags & BUILTIN_KEEP_REDIRS);
+            trace_pipeline(desc, 0, 0, t0, 0, trace_now_us(), 0, last_exit_status);
+            free(desc);
         } else {
-            *q++ = *p++;
+            last_exit_status = run_with_redirs(c, b->fn, b->flags & BUILTIN_KEEP_REDIRS);
         }
+        set_pipestatus(&last_exit_status, 1);
+    } else if (exec_in_place && last) {
+        exec_simple(c);
+    } else if (c->nredirs == 0 && !is_stage_prefix(c->argv[0])) {
+        run_simple(c, origline);
+    } else {
+        execute_pipeline(cmds, 1, 0, origline, -1, -1);
     }
-    *q = '\0';
-    return buf;
+    fflush(stdout);
+
+    free_commands(cmds, ncmds);
+    free(cmds);
+    free(cmdline);
 }
 
+// Runs a list's pipelines in order, skipping as && and || say, until one
+// of them returns from the enclosing function. top: nothing follows the
+// list, so its last pipeline is the last thing this process runs.
+static void exec_list(list_t *l, int top) {
+    for (int i = 0; i < l->nitems && !return_pending(); i++) {
+        pipeline_t *p = &l->items[i];
+        if (p->op == LIST_AND && last_exit_status != 0) continue;
+        if (p->op == LIST_OR && last_exit_status == 0) continue;
+        exec_pipeline(p, top && i == l->nitems - 1);
+    }
+}
+
+// Takes one line of input. A command that is still open (quote, "{",
+// trailing "|" or "&&", ...) is kept until the lines that finish it arrive.
 void run_command(char *input) {
-    char *expanded = expand_variables(input);
+    char *text = input;
+    if (pending) {
+        size_t a = strlen(pending), b = strlen(input);
+        char *joined = realloc(pending, a + b + 2);
+        if (!joined) { perror("tsh"); run_command_abandon(); return; }
+        joined[a] = '\n';
+        memcpy(joined + a + 1, input, b + 1);
+        text = joined;
+        pending = NULL;
+    }
+
+    list_t *prog;
+    parse_status_t status = parse_program(text, &prog);
+    if (status == PARSE_INCOMPLETE) {
+        pending = (text == input) ? strdup(input) : text;
+        return;
+    }
+    if (status == PARSE_ERROR) last_exit_status = 2;
+    if (prog) {
+        exec_list(prog, 1);
+        list_release(prog);
+    }
+    if (text != input) free(text);
+}
+
+int run_command_pending(void) {
+    return pending != NULL;
+}
+
+// The input ended in the middle of a command.
+void run_command_abandon(void) {
+    if (!pending) return;
+    free(pending);
+    pending = NULL;
+    fprintf(stderr, "tsh: syntax error: unexpected EOF\n");
+    last_exit_status = 2;
+}
 
-    char *line = strdup(expanded);
-    if (!line) return;
-    size_t L = strlen(line); if (L>0 && line[L-1]=='\n') line[L-1]='\0';
-    if (line[0] == '\0') { free(line); return; }
+// ^C at the secondary prompt: the unfinished command is dropped quietly.
+void run_command_cancel(void) {
+    free(pending);
+    pending = NULL;
+    last_exit_status = 130;
+}
 
-    add_history(input);
+int shell_last_status(void) {
+    return last_exit_status;
+}
 
-    command_t cmds[MAX_CMDS];
-    int background = 0;
-    int ncmds = parse_line(line, cmds, &background);
-    if (ncmds <= 0) { free(line); return; }
+void shell_set_last_status(int status) {
+    last_exit_status = status;
+}
 
-    if (ncmds == 1 && is_builtin(&cmds[0])) {
-        handle_builtin(&cmds[0]);
-        free(line);
-        return;
+// Returns the previous setting, so it can be put back.
+int shell_set_exec_in_place(int on) {
+    int was = exec_in_place;
+    exec_in_place = on;
+    return was;
+}
+
+void shell_init_signals(int interactive) {
+    install_sigchld();
+    signal(SIGHUP, sighup_handler);
+
+    // With a terminal, keyboard signals go straight to the foreground job;
+    // without one, the shell forwards them itself.
+    if (interactive) {
+        init_job_control();
+    } else {
+        signal(SIGINT, sigint_handler);
+        signal(SIGTSTP, sigtstp_handler);
     }
+}
+
+static const char *cached_host(void) {
+    static char host[256];
+    if (host[0] == '\0' && gethostname(host, sizeof(host)) != 0) strcpy(host, "unknown");
+    return host;
+}
 
-    execute_pipeline(cmds, ncmds, background, line);
+static void build_prompt(char *prompt, size_t size) {
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, "?");
 
-    if (!background) free(line);
+    char *user = getenv("USER");
+    if (!user) user = "user";
+
+    char display_path[4096];
+    char *home = getenv("HOME");
+    if (home && strncmp(cwd, home, strlen(home)) == 0) {
+         snprintf(display_path, sizeof(display_path), "~%s", cwd + strlen(home));
+    } else {
+         strncpy(display_path, cwd, sizeof(display_path));
+         display_path[sizeof(display_path)-1] = '\0';
+    }
+
+    snprintf(prompt, size, "\033[1;32m%s@%s\033[0m:\033[1;34m%s\033[0m$ ", user, cached_host(), display_path);
 }
 
-int main(void) {
-    init_jobs();
+static void usage(void) {
+    fprintf(stderr, "usage: tsh [--startup-profile] [--trace FILE]\n       tsh --serve SOCKET\n");
+}
 
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sigchld_handler;
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sigaction(SIGCHLD, &sa, NULL);
+static void finish_trace(void) {
+    trace_done_jobs();
+    trace_close();
+}
+
+int main(int argc, char **argv) {
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0) {
+        init_jobs();
+        return serve(argv[2]) < 0 ? 1 : 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--startup-profile") == 0) {
+            profile_enable();
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            if (trace_open(argv[++i]) < 0) { fprintf(stderr, "tsh: %s: %s\n", argv[i], strerror(errno)); return 1; }
+            atexit(finish_trace);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    // Prompt and terminal setup are only paid for when a user is attached.
+    int interactive = isatty(STDIN_FILENO);
+
+    profile_begin(PROF_JOBS);
+    init_jobs();
+    profile_end(PROF_JOBS);
 
-    signal(SIGINT, sigint_handler);
-    signal(SIGTSTP, sigtstp_handler);
+    profile_begin(PROF_SIGNALS);
+    shell_init_signals(interactive);
+    profile_end(PROF_SIGNALS);
 
     char *input = NULL;
+    char prompt[8192];
 
     while (1) {
-        char host[256];
-        if (gethostname(host, sizeof(host)) != 0) strcpy(host, "unknown");
-        char cwd[4096];
-        if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, "?");
-        
-        char *user = getenv("USER");
-        if (!user) user = "user";
-
-        char *path = cwd;
-        char *home = getenv("HOME");
-        if (home && strncmp(cwd, home, strlen(home)) == 0) {
-            path = cwd + strlen(home);
-            if (*path == '\0') path = "~";
-        }
-        char prompt[8192];
-        char display_path[4096];
-        if (home && strncmp(cwd, home, strlen(home)) == 0) {
-             snprintf(display_path, sizeof(display_path), "~%s", cwd + strlen(home));
-        } else {
-             strncpy(display_path, cwd, sizeof(display_path));
+        // A command continued on the next line gets the secondary prompt.
+        int more = run_command_pending();
+        if (interactive && !more) {
+            profile_begin(PROF_PROMPT);
+            build_prompt(prompt, sizeof(prompt));
+            profile_end(PROF_PROMPT);
         }
-        
-        snprintf(prompt, sizeof(prompt), "\033[1;32m%s@%s\033[0m:\033[1;34m%s\033[0m$ ", user, host, display_path);
 
-        input = tsh_readline(prompt);
+        input = tsh_readline(interactive ? (more ? "> " : prompt) : NULL);
+        profile_report();
         if (!input) {
-            printf("\n");
+            if (interactive) printf("\n");
+            run_command_abandon();
+            // Ctrl-D inside a command only ends that command.
+            if (interactive && more) continue;
             break; 
         }
+        if (more && tsh_readline_interrupted()) {
+            run_command_cancel();
+            free(input);
+            continue;
+        }
         
+        // Only lines a user typed are history; scripts on stdin are not.
+        if (interactive) add_history(input);
         run_command(input);
         free(input);
+
+        if (trace_enabled()) {
+            trace_done_jobs();
+            if (interactive) trace_flush();
+        }
     }
 
     free_history();
     free_jobs();
+    free_functions();
+    alias_clear();
     return 0;
-}
\ No newline at end of file
+}
@@ -2,120 +2,521 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <glob.h>
 #include "parser.h"
 
-static char *next_token(char **s) {
-    char *p = *s;
-    if (!p) return NULL;
-    while (isspace((unsigned char)*p)) p++;
-    if (*p == '\0') { *s = NULL; return NULL; }
-
-    char *start = p;
-    if (*p == '"' || *p == '\'') {
-        char quote = *p++;
-        start = p;
-        while (*p && *p != quote) {
-            if (*p == '\\' && p[1]) p += 2; else p++;
-        }
-        if (*p == quote) {
-            *p = '\0';
+typedef enum {
+    TOK_END,
+    TOK_WORD,
+    TOK_NEWLINE,
+    TOK_PIPE,
+    TOK_AMP,
+    TOK_SEMI,
+    TOK_AND_IF,
+    TOK_OR_IF,
+    TOK_LPAREN,
+    TOK_RPAREN,
+    TOK_REDIR
+} tok_type_t;
+
+#define MAX_ALIAS_DEPTH 16
+
+typedef struct lexer {
+    const char *p;
+    struct {
+        const char *resume;     // where the text that used the alias continues
+        const char *name;
+    } aliases[MAX_ALIAS_DEPTH];
+    int depth;
+    int incomplete;             // input ended inside quotes or after a backslash
+} lexer_t;
+
+typedef struct token {
+    tok_type_t type;
+    char *word;     // raw text, quotes included; owned by whoever consumes it
+    int io_number;  // fd glued to a redirection ("2>"), -1 if absent
+    redir_type_t redir;
+} token_t;
+
+typedef struct parser {
+    lexer_t lx;
+    token_t tok;
+    int have_tok;
+    parse_status_t status;
+} parser_t;
+
+typedef struct alias {
+    char *name;
+    char *value;
+} alias_t;
+
+static alias_t *aliases = NULL;
+static int naliases = 0;
+
+static int is_op_char(char c) {
+    return c == '<' || c == '>' || c == '|' || c == '&' || c == ';' || c == '(' || c == ')';
+}
+
+static int is_blank(char c) {
+    return c != '\n' && isspace((unsigned char)c);
+}
+
+static void lex_operator(lexer_t *lx, token_t *t) {
+    const char *p = lx->p;
+    char c = *p++;
+    switch (c) {
+        case '|': t->type = (*p == '|') ? (p++, TOK_OR_IF) : TOK_PIPE; break;
+        case '&': t->type = (*p == '&') ? (p++, TOK_AND_IF) : TOK_AMP; break;
+        case ';': t->type = TOK_SEMI; break;
+        case '(': t->type = TOK_LPAREN; break;
+        case ')': t->type = TOK_RPAREN; break;
+        default:
+            t->type = TOK_REDIR;
+            if (c == '>' && *p == '>') { p++; t->redir = REDIR_APPEND; }
+            else if (*p == '&')        { p++; t->redir = REDIR_DUP; }
+            else t->redir = (c == '<') ? REDIR_IN : REDIR_OUT;
+            if (t->io_number < 0) t->io_number = (c == '<') ? 0 : 1;
+    }
+    lx->p = p;
+}
+
+// Words are returned as written; quote removal and expansion happen when
+// the command runs. Only the word boundaries are decided here.
+static void next_token(lexer_t *lx, token_t *t) {
+    t->word = NULL;
+    t->io_number = -1;
+
+    const char *p;
+    for (;;) {
+        p = lx->p;
+        while (is_blank(*p) || (*p == '\\' && p[1] == '\n')) p += (*p == '\\') ? 2 : 1;
+        // An unquoted '#' starting a word comments out the rest of the line.
+        if (*p == '#') while (*p && *p != '\n') p++;
+        if (*p != '\0' || lx->depth == 0) break;
+        lx->p = lx->aliases[--lx->depth].resume;
+    }
+
+    if (*p == '\0') { lx->p = p; t->type = TOK_END; return; }
+    if (*p == '\n') { lx->p = p + 1; t->type = TOK_NEWLINE; return; }
+    if (is_op_char(*p)) { lx->p = p; lex_operator(lx, t); return; }
+
+    const char *start = p;
+    int digits = 1;
+    while (*p && *p != '\n' && !is_blank(*p) && !is_op_char(*p)) {
+        if (*p == '\'' || *p == '"') {
+            char quote = *p++;
+            while (*p && *p != quote) {
+                if (quote == '"' && *p == '\\' && p[1]) p++;
+                p++;
+            }
+            if (!*p) { lx->incomplete = 1; break; }
             p++;
-        }
-        *s = p;
-        return start;
-    }
-
-    if (p[0] == '>' && p[1] == '>') {
-        *s = p + 2;
-        return ">>";
-    }
-    if (*p == '<' || *p == '>' || *p == '|' || *p == '&') {
-        static char op[2];
-        op[0] = *p;
-        op[1] = '\0';
-        *s = p + 1;
-        return op;
-    }
-
-    start = p;
-    while (*p && !isspace((unsigned char)*p) && *p != '<' && *p != '>' && *p != '|' && *p != '&') p++;
-    if (*p) {
-        *p = '\0';
-        *s = p + 1;
-    } else {
-        *s = NULL;
-    }
-    return start;
-}
-
-int parse_line(char *line, command_t cmds[], int *background) {
-    char *p = line;
-    int cmd_idx = 0;
-    int arg_idx = 0;
-    cmds[0].infile = cmds[0].outfile = NULL; cmds[0].append = 0;
-    for (int i=0;i<MAX_CMDS;i++) for (int j=0;j<MAX_ARGS;j++) cmds[i].argv[j]=NULL;
-
-    *background = 0;
-    char *tok;
-    while ((tok = next_token(&p))) {
-        if (strcmp(tok, "|") == 0) {
-            cmd_idx++;
-            if (cmd_idx >= MAX_CMDS) { fprintf(stderr, "tsh: too many piped commands\n"); return -1; }
-            arg_idx = 0;
-            cmds[cmd_idx].infile = cmds[cmd_idx].outfile = NULL; cmds[cmd_idx].append = 0;
-            continue;
-        }
-        if (strcmp(tok, "<") == 0) {
-            char *file = next_token(&p);
-            if (!file) { fprintf(stderr, "tsh: syntax error: expected filename after '<'\n"); return -1; }
-            cmds[cmd_idx].infile = file;
+            digits = 0;
             continue;
         }
-        if (strcmp(tok, ">") == 0 || strcmp(tok, ">>") == 0) {
-            int append = (strcmp(tok, ">>") == 0);
-            char *file = next_token(&p);
-            if (!file) { fprintf(stderr, "tsh: syntax error: expected filename after '>'\n"); return -1; }
-            cmds[cmd_idx].outfile = file;
-            cmds[cmd_idx].append = append;
+        if (*p == '\\') {
+            if (!p[1]) { lx->incomplete = 1; p++; break; }
+            p += 2;
+            digits = 0;
             continue;
         }
-        if (strcmp(tok, "&") == 0) {
-            *background = 1;
-            continue;
+        if (!isdigit((unsigned char)*p)) digits = 0;
+        p++;
+    }
+
+    if (digits && p > start && (*p == '<' || *p == '>')) {
+        t->io_number = atoi(start);
+        lx->p = p;
+        lex_operator(lx, t);
+        return;
+    }
+    lx->p = p;
+    t->type = TOK_WORD;
+    t->word = strndup(start, p - start);
+}
+
+static tok_type_t peek(parser_t *ps) {
+    if (!ps->have_tok) {
+        next_token(&ps->lx, &ps->tok);
+        ps->have_tok = 1;
+    }
+    return ps->tok.type;
+}
+
+// The caller takes ownership of tok.word, if any.
+static void consume(parser_t *ps) {
+    ps->have_tok = 0;
+}
+
+static void discard(parser_t *ps) {
+    free(ps->tok.word);
+    ps->tok.word = NULL;
+    ps->have_tok = 0;
+}
+
+static int peek_word(parser_t *ps, const char *word) {
+    return peek(ps) == TOK_WORD && strcmp(ps->tok.word, word) == 0;
+}
+
+static void skip_newlines(parser_t *ps) {
+    while (peek(ps) == TOK_NEWLINE) consume(ps);
+}
+
+static const char *token_text(const token_t *t) {
+    switch (t->type) {
+        case TOK_WORD:    return t->word;
+        case TOK_NEWLINE: return "newline";
+        case TOK_PIPE:    return "|";
+        case TOK_AMP:     return "&";
+        case TOK_SEMI:    return ";";
+        case TOK_AND_IF:  return "&&";
+        case TOK_OR_IF:   return "||";
+        case TOK_LPAREN:  return "(";
+        case TOK_RPAREN:  return ")";
+        case TOK_REDIR:   return t->redir == REDIR_IN ? "<" : t->redir == REDIR_APPEND ? ">>" : ">";
+        case TOK_END:     break;
+    }
+    return "end of file";
+}
+
+// Running out of input is not an error yet: the caller may have more lines.
+static void syntax_error(parser_t *ps) {
+    if (ps->status != PARSE_OK) return;
+    if (peek(ps) == TOK_END) { ps->status = PARSE_INCOMPLETE; return; }
+    fprintf(stderr, "tsh: syntax error near '%s'\n", token_text(&ps->tok));
+    ps->status = PARSE_ERROR;
+}
+
+static void parse_fail(parser_t *ps, const char *msg) {
+    if (ps->status != PARSE_OK) return;
+    fprintf(stderr, "tsh: %s\n", msg);
+    ps->status = PARSE_ERROR;
+}
+
+static void free_stage(stage_t *st) {
+    for (int i = 0; i < st->nwords; i++) free(st->words[i]);
+    free(st->words);
+    for (int i = 0; i < st->nredirs; i++) free(st->redirs[i].target);
+    free(st->redirs);
+    list_release(st->group);
+    free(st->funcname);
+}
+
+static void free_pipeline(pipeline_t *p) {
+    for (int i = 0; i < p->nstages; i++) free_stage(&p->stages[i]);
+    free(p->stages);
+    free(p->text);
+}
+
+list_t *list_retain(list_t *l) {
+    if (l) l->refs++;
+    return l;
+}
+
+void list_release(list_t *l) {
+    if (!l || --l->refs > 0) return;
+    for (int i = 0; i < l->nitems; i++) free_pipeline(&l->items[i]);
+    free(l->items);
+    free(l);
+}
+
+// Grows *arr (of elem-sized items, *n in use) to hold one more.
+static int grow(void *arr, int n, size_t elem) {
+    if (n & (n - 1)) return 0;  // capacity is the next power of two
+    void *p = realloc(*(void **)arr, elem * (n ? n * 2 : 1));
+    if (!p) return -1;
+    *(void **)arr = p;
+    return 0;
+}
+
+static int valid_name(const char *s) {
+    if (!*s || isdigit((unsigned char)*s)) return 0;
+    for (; *s; s++) if (!isalnum((unsigned char)*s) && *s != '_' && *s != '-' && *s != '.') return 0;
+    return 1;
+}
+
+static int plain_word(const char *s) {
+    return !strpbrk(s, "'\"\\$`");
+}
+
+static list_t *parse_list(parser_t *ps, int nested);
+
+static int parse_redir(parser_t *ps, stage_t *st) {
+    token_t r = ps->tok;
+    consume(ps);
+    if (peek(ps) == TOK_END) { parse_fail(ps, "syntax error: expected filename after redirection"); return -1; }
+    if (peek(ps) != TOK_WORD) { syntax_error(ps); return -1; }
+    if (st->nredirs >= MAX_REDIRS) { parse_fail(ps, "too many redirections"); return -1; }
+    if (grow(&st->redirs, st->nredirs, sizeof(redir_t)) < 0) { parse_fail(ps, "out of memory"); return -1; }
+    redir_t *rd = &st->redirs[st->nredirs++];
+    rd->fd = r.io_number;
+    rd->type = r.redir;
+    rd->target = ps->tok.word;
+    consume(ps);
+    if (rd->type == REDIR_DUP && strcmp(rd->target, "-") == 0) rd->type = REDIR_CLOSE;
+    return 0;
+}
+
+// "{" list "}"; the opening brace is the current token.
+static list_t *parse_group(parser_t *ps) {
+    discard(ps);
+    list_t *body = parse_list(ps, 1);
+    if (!body) return NULL;
+    if (!peek_word(ps, "}")) { syntax_error(ps); list_release(body); return NULL; }
+    discard(ps);
+    return body;
+}
+
+static int parse_funcdef(parser_t *ps, stage_t *st, char *name) {
+    st->funcname = name;
+    if (!valid_name(name)) {
+        fprintf(stderr, "tsh: `%s': not a valid function name\n", name);
+        ps->status = PARSE_ERROR;
+        return -1;
+    }
+    skip_newlines(ps);
+    if (!peek_word(ps, "{")) { syntax_error(ps); return -1; }
+    st->group = parse_group(ps);
+    return st->group ? 0 : -1;
+}
+
+static int parse_command(parser_t *ps, stage_t *st) {
+    memset(st, 0, sizeof(*st));
+
+    // Aliases replace the command word before anything else looks at it.
+    while (peek(ps) == TOK_WORD && plain_word(ps->tok.word)) {
+        const char *value = alias_get(ps->tok.word);
+        lexer_t *lx = &ps->lx;
+        int active = 0;
+        for (int i = 0; i < lx->depth; i++) if (strcmp(lx->aliases[i].name, ps->tok.word) == 0) active = 1;
+        if (!value || active || lx->depth == MAX_ALIAS_DEPTH) break;
+        lx->aliases[lx->depth].resume = lx->p;
+        lx->aliases[lx->depth].name = value - strlen(ps->tok.word) - 1;  // see alias_set
+        lx->depth++;
+        lx->p = value;
+        discard(ps);
+    }
+
+    if (peek_word(ps, "{")) {
+        st->group = parse_group(ps);
+        if (!st->group) return -1;
+        while (peek(ps) == TOK_REDIR) if (parse_redir(ps, st) < 0) return -1;
+        return 0;
+    }
+    if (peek_word(ps, "}")) { syntax_error(ps); return -1; }
+    if (peek_word(ps, "function")) {
+        discard(ps);
+        if (peek(ps) != TOK_WORD) { syntax_error(ps); return -1; }
+        char *name = ps->tok.word;
+        consume(ps);
+        if (peek(ps) == TOK_LPAREN) {
+            consume(ps);
+            if (peek(ps) != TOK_RPAREN) { st->funcname = name; syntax_error(ps); return -1; }
+            consume(ps);
         }
+        return parse_funcdef(ps, st, name);
+    }
 
-        // Globbing check
-        if (strchr(tok, '*') || strchr(tok, '?')) {
-            glob_t glob_result;
-            memset(&glob_result, 0, sizeof(glob_result));
-            
-            // Flags: GLOB_NOCHECK (return pattern if no match), GLOB_TILDE (expand ~)
-            // But GLOB_NOCHECK matches the requirement "Handle GLOB_NOMATCH (keep the original token)"
-            int return_value = glob(tok, GLOB_NOCHECK | GLOB_TILDE, NULL, &glob_result);
-            
-            if (return_value != 0) {
-                // Error or no match (if NOCHECK not used, but we used it, so it returns single item on no match)
-                // If error, just use token
-                if (glob_result.gl_pathc > 0) { 
-                    // Should theoretically not happen on error unless partial?
-                    // Safe fallback
-                } else {
-                     cmds[cmd_idx].argv[arg_idx++] = tok;
-                     if (arg_idx >= MAX_ARGS-1) { fprintf(stderr, "tsh: too many args\n"); return -1; }
-                }
-            } else {
-                 for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
-                     cmds[cmd_idx].argv[arg_idx++] = strdup(glob_result.gl_pathv[i]);
-                     if (arg_idx >= MAX_ARGS-1) { fprintf(stderr, "tsh: too many args\n"); globfree(&glob_result); return -1; }
-                 }
+    for (;;) {
+        tok_type_t t = peek(ps);
+        if (t == TOK_WORD) {
+            if (grow(&st->words, st->nwords, sizeof(char *)) < 0) { parse_fail(ps, "out of memory"); return -1; }
+            st->words[st->nwords++] = ps->tok.word;
+            consume(ps);
+            if (st->nwords == 1 && st->nredirs == 0 && peek(ps) == TOK_LPAREN) {
+                consume(ps);
+                if (peek(ps) != TOK_RPAREN) { syntax_error(ps); return -1; }
+                consume(ps);
+                char *name = st->words[0];
+                st->nwords = 0;
+                return parse_funcdef(ps, st, name);
             }
-            globfree(&glob_result);
-            continue;
+        } else if (t == TOK_REDIR) {
+            if (parse_redir(ps, st) < 0) return -1;
+        } else {
+            break;
+        }
+    }
+    if (st->nwords == 0 && st->nredirs == 0) { syntax_error(ps); return -1; }
+    return 0;
+}
+
+static const char *redir_op(const redir_t *r) {
+    switch (r->type) {
+        case REDIR_IN:     return "<";
+        case REDIR_OUT:    return ">";
+        case REDIR_APPEND: return ">>";
+        case REDIR_DUP:    return r->fd == 0 ? "<&" : ">&";
+        case REDIR_CLOSE:  return ">&";
+    }
+    return "";
+}
+
+// Rebuilds the pipeline's text from its words, for jobs and traces.
+static char *pipeline_text(const pipeline_t *p) {
+    // Room for exactly what the loop below can write, plus the '\0'.
+    size_t len = 1;
+    for (int i = 0; i < p->nstages; i++) {
+        const stage_t *st = &p->stages[i];
+        len += strlen(" | ") + strlen("{ ... }");
+        for (int j = 0; j < st->nwords; j++) len += strlen(st->words[j]) + 1;
+        // " " fd, up to 11 chars for an int, op, then the target or "-".
+        for (int j = 0; j < st->nredirs; j++) len += 1 + 11 + 3 + strlen(st->redirs[j].target) + 1;
+    }
+    char *text = malloc(len);
+    if (!text) return NULL;
+    size_t n = 0;
+    for (int i = 0; i < p->nstages; i++) {
+        const stage_t *st = &p->stages[i];
+        if (i > 0) n += sprintf(text + n, " | ");
+        if (st->group) n += sprintf(text + n, "{ ... }");
+        for (int j = 0; j < st->nwords; j++) n += sprintf(text + n, "%s%s", j ? " " : "", st->words[j]);
+        for (int j = 0; j < st->nredirs; j++) {
+            const redir_t *r = &st->redirs[j];
+            int std_fd = (r->type == REDIR_IN || (r->type == REDIR_DUP && r->fd == 0)) ? 0 : 1;
+            if (r->fd != std_fd) n += sprintf(text + n, " %d", r->fd);
+            else text[n++] = ' ';
+            n += sprintf(text + n, "%s%s", redir_op(r), r->type == REDIR_CLOSE ? "-" : r->target);
+        }
+    }
+    text[n] = '\0';
+    return text;
+}
+
+static int parse_pipeline(parser_t *ps, pipeline_t *p) {
+    memset(p, 0, sizeof(*p));
+    for (;;) {
+        if (p->nstages >= MAX_CMDS) { parse_fail(ps, "too many piped commands"); return -1; }
+        if (grow(&p->stages, p->nstages, sizeof(stage_t)) < 0) { parse_fail(ps, "out of memory"); return -1; }
+        stage_t *st = &p->stages[p->nstages];
+        int rc = parse_command(ps, st);
+        p->nstages++;
+        if (rc < 0) return -1;
+        if (st->funcname && peek(ps) == TOK_PIPE) { syntax_error(ps); return -1; }
+        if (peek(ps) != TOK_PIPE) break;
+        consume(ps);
+        skip_newlines(ps);
+    }
+    p->text = pipeline_text(p);
+    return 0;
+}
+
+// nested: inside "{ }", where a "}" in command position ends the list.
+static list_t *parse_list(parser_t *ps, int nested) {
+    list_t *l = calloc(1, sizeof(*l));
+    if (!l) { parse_fail(ps, "out of memory"); return NULL; }
+    l->refs = 1;
+
+    list_op_t op = LIST_SEQ;
+    for (;;) {
+        skip_newlines(ps);
+        tok_type_t t = peek(ps);
+        if (t == TOK_END || (nested && peek_word(ps, "}"))) {
+            if (op != LIST_SEQ || (nested && t == TOK_END)) { syntax_error(ps); goto fail; }
+            break;
         }
 
-        cmds[cmd_idx].argv[arg_idx++] = tok;
-        if (arg_idx >= MAX_ARGS-1) { fprintf(stderr, "tsh: too many args\n"); return -1; }
+        if (grow(&l->items, l->nitems, sizeof(pipeline_t)) < 0) { parse_fail(ps, "out of memory"); goto fail; }
+        pipeline_t *p = &l->items[l->nitems++];
+        if (parse_pipeline(ps, p) < 0) goto fail;
+        p->op = op;
+
+        t = peek(ps);
+        op = LIST_SEQ;
+        if (t == TOK_AND_IF || t == TOK_OR_IF) {
+            op = (t == TOK_AND_IF) ? LIST_AND : LIST_OR;
+            consume(ps);
+        } else if (t == TOK_AMP || t == TOK_SEMI || t == TOK_NEWLINE) {
+            p->background = (t == TOK_AMP);
+            consume(ps);
+        } else if (t != TOK_END && !(nested && peek_word(ps, "}"))) {
+            syntax_error(ps);
+            goto fail;
+        }
     }
-    return cmd_idx+1;
+    return l;
+
+fail:
+    list_release(l);
+    return NULL;
+}
+
+// Parses a whole program. *out is NULL when the text holds no commands.
+// On PARSE_ERROR the message has been printed; PARSE_INCOMPLETE means the
+// text is a valid beginning and the caller should append the next line.
+parse_status_t parse_program(const char *text, list_t **out) {
+    parser_t ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.lx.p = text;
+    ps.status = PARSE_OK;
+    *out = NULL;
+
+    list_t *l = parse_list(&ps, 0);
+    if (ps.have_tok) discard(&ps);
+    if (ps.lx.incomplete && ps.status != PARSE_ERROR) ps.status = PARSE_INCOMPLETE;
+    if (ps.status != PARSE_OK) {
+        list_release(l);
+        return ps.status;
+    }
+    if (l && l->nitems == 0) { list_release(l); l = NULL; }
+    *out = l;
+    return PARSE_OK;
+}
+
+void free_commands(command_t cmds[], int ncmds) {
+    for (int i = 0; i < ncmds; i++) {
+        for (int j = 0; j < cmds[i].nowned; j++) free(cmds[i].owned[j]);
+        cmds[i].nowned = 0;
+    }
+}
+
+// Each entry is stored as "name\0value", so the lexer can keep the name
+// of an alias in use next to its text.
+int alias_set(const char *name, const char *value) {
+    if (!valid_name(name)) return -1;
+    size_t nlen = strlen(name), vlen = strlen(value);
+    char *entry = malloc(nlen + vlen + 2);
+    if (!entry) return -1;
+    memcpy(entry, name, nlen + 1);
+    memcpy(entry + nlen + 1, value, vlen + 1);
+
+    for (int i = 0; i < naliases; i++) {
+        if (strcmp(aliases[i].name, name) == 0) {
+            free(aliases[i].name);
+            aliases[i].name = entry;
+            aliases[i].value = entry + nlen + 1;
+            return 0;
+        }
+    }
+    if (grow(&aliases, naliases, sizeof(alias_t)) < 0) { free(entry); return -1; }
+    aliases[naliases].name = entry;
+    aliases[naliases].value = entry + nlen + 1;
+    naliases++;
+    return 0;
+}
+
+const char *alias_get(const char *name) {
+    for (int i = 0; i < naliases; i++) if (strcmp(aliases[i].name, name) == 0) return aliases[i].value;
+    return NULL;
+}
+
+int alias_unset(const char *name) {
+    for (int i = 0; i < naliases; i++) {
+        if (strcmp(aliases[i].name, name) == 0) {
+            free(aliases[i].name);
+            aliases[i] = aliases[--naliases];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void alias_clear(void) {
+    for (int i = 0; i < naliases; i++) free(aliases[i].name);
+    free(aliases);
+    aliases = NULL;
+    naliases = 0;
+}
+
+void alias_print(void) {
+    for (int i = 0; i < naliases; i++) printf("alias %s='%s'\n", aliases[i].name, aliases[i].value);
 }
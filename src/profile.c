@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <time.h>
+#include "profile.h"
+
+static int enabled = 0;
+static int reported = 0;
+static struct timespec t_start;
+static struct timespec t_begin[PROF_NPHASES];
+static long phase_us[PROF_NPHASES];
+static int phase_ran[PROF_NPHASES];
+
+static const char *phase_names[PROF_NPHASES] = {
+    "signals", "init_jobs", "prompt", "terminal"
+};
+
+static long elapsed_us(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+void profile_enable(void) {
+    enabled = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+}
+
+void profile_begin(profile_phase_t phase) {
+    if (!enabled) return;
+    clock_gettime(CLOCK_MONOTONIC, &t_begin[phase]);
+}
+
+void profile_end(profile_phase_t phase) {
+    if (!enabled) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    phase_us[phase] += elapsed_us(&t_begin[phase], &now);
+    phase_ran[phase] = 1;
+}
+
+// Printed once, when the first command line has been read (or at EOF).
+void profile_report(void) {
+    if (!enabled || reported) return;
+    reported = 1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    fprintf(stderr, "tsh: startup profile (us)\n");
+    for (int i = 0; i < PROF_NPHASES; i++) {
+        if (phase_ran[i]) fprintf(stderr, "  %-14s %8ld\n", phase_names[i], phase_us[i]);
+        else              fprintf(stderr, "  %-14s %8s\n", phase_names[i], "skipped");
+    }
+    fprintf(stderr, "  %-14s %8ld\n", "first command", elapsed_us(&t_start, &now));
+}
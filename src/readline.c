@@ -7,38 +7,54 @@
 #include <dirent.h>
 #include "readline.h"
 #include "builtins.h"
+#include "profile.h"
 
 #define MAX_NAME_LEN 1024
 
 #define BUF_SIZE 4096
 
 static struct termios orig_termios;
+static struct termios raw_termios;
 static int raw_mode_enabled = 0;
+static int termios_saved = 0;
+static int stdin_tty = -1;
+static int interrupted = 0;     // the last line was ended by ^C
 
 static void disable_raw_mode(void) {
     if (raw_mode_enabled) {
-        tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_termios);
         raw_mode_enabled = 0;
     }
 }
 
+// The cooked/raw pair is computed on first use only; later prompts are a
+// single tcsetattr.
 static void enable_raw_mode(void) {
-    if (!isatty(STDIN_FILENO)) return;
-    if (tcgetattr(STDIN_FILENO, &orig_termios) == -1) return;
-    
-    struct termios raw = orig_termios;
-    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
-    raw.c_iflag &= ~(IXON);
-    
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) return;
+    if (!termios_saved) {
+        profile_begin(PROF_TERMINAL);
+        if (tcgetattr(STDIN_FILENO, &orig_termios) == -1) { profile_end(PROF_TERMINAL); return; }
+        raw_termios = orig_termios;
+        raw_termios.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+        raw_termios.c_iflag &= ~(IXON);
+        termios_saved = 1;
+        profile_end(PROF_TERMINAL);
+    }
+
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios) == -1) return;
     raw_mode_enabled = 1;
 }
 
+int tsh_readline_interrupted(void) {
+    return interrupted;
+}
+
 char *tsh_readline(const char *prompt) {
-    if (!isatty(STDIN_FILENO)) {
+    interrupted = 0;
+    if (stdin_tty < 0) stdin_tty = isatty(STDIN_FILENO);
+    if (!stdin_tty) {
         char *line = NULL;
         size_t len = 0;
-        printf("%s", prompt); fflush(stdout);
+        if (prompt) { printf("%s", prompt); fflush(stdout); }
         if (getline(&line, &len, stdin) == -1) { free(line); return NULL; }
         size_t L = strlen(line);
         if (L>0 && line[L-1]=='\n') line[L-1]='\0';
@@ -53,10 +69,12 @@ char *tsh_readline(const char *prompt) {
     int history_idx = get_history_length();
     char *saved_current_line = NULL;
 
-    printf("%s", prompt); fflush(stdout);
-
+    // Raw mode first: a key typed as soon as the prompt shows is then read
+    // here instead of being turned into a signal by the terminal.
     enable_raw_mode();
 
+    if (prompt) { printf("%s", prompt); fflush(stdout); }
+
     while (1) {
         char c;
         int nread = read(STDIN_FILENO, &c, 1);
@@ -128,6 +146,7 @@ char *tsh_readline(const char *prompt) {
             buf[0] = '\0';
             len = 0;
             pos = 0;
+            interrupted = 1;
             break;
         } else if (c == 4) {
              if (len == 0) {
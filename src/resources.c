@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include "resources.h"
+
+typedef struct limit_desc {
+    char opt;
+    int resource;
+    rlim_t unit;
+    const char *desc;
+} limit_desc_t;
+
+static const limit_desc_t limits[] = {
+    { 'c', RLIMIT_CORE,    1024, "core file size (blocks)" },
+    { 'd', RLIMIT_DATA,    1024, "data seg size (kbytes)" },
+    { 'f', RLIMIT_FSIZE,   1024, "file size (blocks)" },
+    { 'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)" },
+    { 'm', RLIMIT_RSS,     1024, "max memory size (kbytes)" },
+    { 'n', RLIMIT_NOFILE,  1,    "open files" },
+    { 's', RLIMIT_STACK,   1024, "stack size (kbytes)" },
+    { 't', RLIMIT_CPU,     1,    "cpu time (seconds)" },
+    { 'u', RLIMIT_NPROC,   1,    "max user processes" },
+    { 'v', RLIMIT_AS,      1024, "virtual memory (kbytes)" },
+    { 0, 0, 0, NULL }
+};
+
+typedef struct ulimit_req {
+    const limit_desc_t *limit;
+    int soft, hard;     // which halves to act on
+    int all;
+    char *value;        // NULL to print
+} ulimit_req_t;
+
+static const limit_desc_t *find_limit(char opt) {
+    for (int i = 0; limits[i].opt; i++) if (limits[i].opt == opt) return &limits[i];
+    return NULL;
+}
+
+// Parses "ulimit [-SH] [-a|-cdflmnstuv] [value]". Returns the number of
+// words consumed, or -1 on a usage error (reported unless quiet).
+static int parse_ulimit(char **argv, ulimit_req_t *req, int quiet) {
+    memset(req, 0, sizeof(*req));
+    req->limit = find_limit('f');
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        for (const char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'S') req->soft = 1;
+            else if (*o == 'H') req->hard = 1;
+            else if (*o == 'a') req->all = 1;
+            else if (!(req->limit = find_limit(*o))) {
+                if (!quiet) fprintf(stderr, "tsh: ulimit: -%c: invalid option\n", *o);
+                return -1;
+            }
+        }
+    }
+    if (!req->all && argv[i]) req->value = argv[i++];
+    return i;
+}
+
+static int parse_limit_value(const limit_desc_t *l, const char *s, rlim_t *out) {
+    if (strcmp(s, "unlimited") == 0) { *out = RLIM_INFINITY; return 0; }
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s || *end || s[0] == '-') return -1;
+    if (v > RLIM_INFINITY / l->unit) return -1;
+    *out = (rlim_t)v * l->unit;
+    return 0;
+}
+
+static int set_limit(const ulimit_req_t *req) {
+    const limit_desc_t *l = req->limit;
+    rlim_t v;
+    if (parse_limit_value(l, req->value, &v) < 0) {
+        fprintf(stderr, "tsh: ulimit: %s: invalid number\n", req->value);
+        return 1;
+    }
+    struct rlimit rl;
+    if (getrlimit(l->resource, &rl) < 0) { perror("tsh: ulimit"); return 1; }
+    // Without -S/-H both halves are set, as in other shells.
+    int soft = req->soft || !req->hard;
+    int hard = req->hard || !req->soft;
+    if (soft) rl.rlim_cur = v;
+    if (hard) rl.rlim_max = v;
+    if (setrlimit(l->resource, &rl) < 0) {
+        fprintf(stderr, "tsh: ulimit: %s: %s\n", l->desc, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static void print_limit(const limit_desc_t *l, int hard, int with_desc) {
+    struct rlimit rl;
+    if (getrlimit(l->resource, &rl) < 0) return;
+    rlim_t v = hard ? rl.rlim_max : rl.rlim_cur;
+    if (with_desc) printf("%-28s(-%c) ", l->desc, l->opt);
+    if (v == RLIM_INFINITY) printf("unlimited\n");
+    else printf("%llu\n", (unsigned long long)(v / l->unit));
+}
+
+// Shell-wide limits: every command started afterwards inherits them.
+int builtin_ulimit(char **argv) {
+    ulimit_req_t req;
+    if (parse_ulimit(argv, &req, 0) < 0) return 2;
+    if (req.all) {
+        for (int i = 0; limits[i].opt; i++) print_limit(&limits[i], req.hard, 1);
+        return 0;
+    }
+    if (!req.value) { print_limit(req.limit, req.hard, 0); return 0; }
+    return set_limit(&req);
+}
+
+// "ulimit -v N cmd ..." limits only cmd; find_builtin uses this to leave
+// that form to the pipeline.
+int ulimit_has_command(char **argv) {
+    ulimit_req_t req;
+    int n = parse_ulimit(argv, &req, 1);
+    return n > 0 && req.value && argv[n] != NULL;
+}
+
+// Accepts "0-3,6" style lists, or "node:N" for the cpus of a NUMA node.
+static int parse_cpu_list(const char *spec, cpu_set_t *set) {
+    char buf[1024];
+    if (strncmp(spec, "node:", 5) == 0) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%s/cpulist", spec + 5);
+        FILE *f = fopen(path, "r");
+        if (!f) return -1;
+        if (!fgets(buf, sizeof(buf), f)) { fclose(f); return -1; }
+        fclose(f);
+        buf[strcspn(buf, "\n")] = '\0';
+        spec = buf;
+    }
+
+    CPU_ZERO(set);
+    const char *p = spec;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0) return -1;
+        long hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = strtol(p + 1, &end, 10);
+            if (end == p + 1 || hi < lo) return -1;
+            p = end;
+        }
+        if (hi >= CPU_SETSIZE) return -1;
+        for (long c = lo; c <= hi; c++) CPU_SET(c, set);
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static int parse_increment(const char *s, int *incr) {
+    if (!s) return -1;
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno || end == s || *end) return -1;
+    *incr = v < -40 ? -40 : v > 40 ? 40 : (int)v;
+    return 0;
+}
+
+// Takes "-n N", "-nN", "-N" and "--adjustment[=]N". Returns 0 for anything
+// else, including a bare "nice" and a "nice" with no command after it, so
+// the stage execs nice(1) itself and it reports or prints as usual.
+static int apply_nice(char **argv) {
+    int incr = 10;
+    int n = 1;
+    const char *a = argv[1];
+    if (a && (strcmp(a, "-n") == 0 || strcmp(a, "--adjustment") == 0)) {
+        if (parse_increment(argv[2], &incr) < 0) return 0;
+        n = 3;
+    } else if (a && strncmp(a, "-n", 2) == 0) {
+        if (parse_increment(a + 2, &incr) < 0) return 0;
+        n = 2;
+    } else if (a && strncmp(a, "--adjustment=", 13) == 0) {
+        if (parse_increment(a + 13, &incr) < 0) return 0;
+        n = 2;
+    } else if (a && a[0] == '-' && isdigit((unsigned char)a[1])) {
+        if (parse_increment(a + 1, &incr) < 0) return 0;
+        n = 2;
+    } else if (a && a[0] == '-' && strcmp(a, "--") != 0) {
+        return 0;
+    }
+    if (argv[n] && strcmp(argv[n], "--") == 0) n++;
+    if (!argv[n]) return 0;
+    errno = 0;
+    int cur = getpriority(PRIO_PROCESS, 0);
+    if (errno == 0 && setpriority(PRIO_PROCESS, 0, cur + incr) < 0) {
+        fprintf(stderr, "tsh: nice: %s\n", strerror(errno));
+        return -1;
+    }
+    return n;
+}
+
+static int apply_cpuset(char **argv) {
+    cpu_set_t set;
+    if (!argv[1]) { fprintf(stderr, "tsh: cpuset: expected cpu list\n"); return -1; }
+    if (parse_cpu_list(argv[1], &set) < 0) {
+        fprintf(stderr, "tsh: cpuset: %s: invalid cpu list\n", argv[1]);
+        return -1;
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "tsh: cpuset: %s\n", strerror(errno));
+        return -1;
+    }
+    return 2;
+}
+
+static int apply_ulimit(char **argv) {
+    ulimit_req_t req;
+    int n = parse_ulimit(argv, &req, 0);
+    if (n < 0) return -1;
+    if (!req.value) { fprintf(stderr, "tsh: ulimit: expected value before command\n"); return -1; }
+    return set_limit(&req) == 0 ? n : -1;
+}
+
+int is_stage_prefix(const char *word) {
+    return strcmp(word, "cpuset") == 0 || strcmp(word, "nice") == 0 || strcmp(word, "ulimit") == 0;
+}
+
+// Runs in a pipeline stage between fork and exec. Strips and applies any
+// leading "cpuset LIST", "nice [-n N]" and "ulimit -X N" words, so
+// placement and limits cost no extra exec. *argvp is left pointing at the
+// command proper.
+int apply_stage_prefixes(char ***argvp) {
+    char **argv = *argvp;
+    while (argv[0]) {
+        int n;
+        if (strcmp(argv[0], "cpuset") == 0) n = apply_cpuset(argv);
+        else if (strcmp(argv[0], "nice") == 0) n = apply_nice(argv);
+        else if (strcmp(argv[0], "ulimit") == 0) n = apply_ulimit(argv);
+        else break;
+        if (n < 0) return -1;
+        if (n == 0) break;      // left for the real command of that name
+        argv += n;
+    }
+    if (!argv[0]) { fprintf(stderr, "tsh: %s: expected command\n", (*argvp)[0]); return -1; }
+    *argvp = argv;
+    return 0;
+}
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "server.h"
+#include "run.h"
+#include "parser.h"
+#include "job_control.h"
+#include "trace.h"
+
+// One client connection. It owns at most one running request at a time;
+// bytes of the next request wait in buf until the reply has gone out.
+typedef struct conn {
+    int fd;
+    char buf[sizeof(uint32_t) + MAX_LINE];
+    size_t len;
+    int fds[3];         // stdio received with the pending request
+    int nfds;
+    pid_t worker;       // 0 while idle
+    long long start_us;
+    int hangup;         // client went away; drop after the worker is reaped
+} conn_t;
+
+static conn_t **conns = NULL;
+static int nconns = 0, conn_cap = 0;
+static int listen_fd = -1;
+static int wake_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t stop_requested = 0;
+
+static void wake(void) {
+    int saved = errno;
+    ssize_t r = write(wake_pipe[1], "x", 1);
+    (void)r;
+    errno = saved;
+}
+
+static void serve_sigchld(int sig) {
+    (void)sig;
+    wake();
+}
+
+static void serve_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+    wake();
+}
+
+static void set_nonblock_cloexec(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void close_received(conn_t *c) {
+    for (int i = 0; i < c->nfds; i++) close(c->fds[i]);
+    c->nfds = 0;
+}
+
+static void drop_conn(int idx) {
+    conn_t *c = conns[idx];
+    close_received(c);
+    close(c->fd);
+    free(c);
+    conns[idx] = conns[--nconns];
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "tsh: --serve: socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by an earlier server is replaced; anything else
+    // at that path is not ours to remove.
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { perror("tsh: socket"); return -1; }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "tsh: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    set_nonblock_cloexec(fd);
+    return fd;
+}
+
+static void accept_clients(void) {
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        set_nonblock_cloexec(fd);
+        conn_t *c = calloc(1, sizeof(*c));
+        if (!c) { close(fd); continue; }
+        if (nconns == conn_cap) {
+            int cap = conn_cap ? conn_cap * 2 : 16;
+            conn_t **grown = realloc(conns, sizeof(*conns) * cap);
+            if (!grown) { free(c); close(fd); continue; }
+            conns = grown;
+            conn_cap = cap;
+        }
+        c->fd = fd;
+        conns[nconns++] = c;
+    }
+}
+
+// Runs in the forked worker: the request gets a private copy of the
+// server's state, so cd or export in one request never leaks into another.
+static void run_worker(conn_t *c, char *line) {
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    setpgid(0, 0);
+
+    for (int k = 0; k < 3; k++) {
+        int fd = k < c->nfds ? c->fds[k] : open("/dev/null", k == 0 ? O_RDONLY : O_WRONLY);
+        if (fd < 0 || dup2(fd, k) < 0) _exit(126);
+    }
+    close_received(c);
+    for (int i = 0; i < nconns; i++) {
+        close(conns[i]->fd);
+        if (conns[i] != c) close_received(conns[i]);
+    }
+    close(listen_fd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+
+    shell_init_signals(0);
+    shell_set_exec_in_place(1);
+    run_command(line);
+    run_command_abandon();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(shell_last_status());
+}
+
+// Starts the request at the front of c->buf, if all of it has arrived.
+static int start_request(conn_t *c) {
+    if (c->worker || c->len < sizeof(uint32_t)) return 0;
+    uint32_t n;
+    memcpy(&n, c->buf, sizeof(n));
+    if (n >= MAX_LINE) return -1;
+    if (c->len < sizeof(n) + n) return 0;
+
+    char line[MAX_LINE];
+    memcpy(line, c->buf + sizeof(n), n);
+    line[n] = '\0';
+    c->len -= sizeof(n) + n;
+    memmove(c->buf, c->buf + sizeof(n) + n, c->len);
+
+    c->start_us = trace_now_us();
+    pid_t pid = fork();
+    if (pid < 0) { perror("tsh: fork"); return -1; }
+    if (pid == 0) run_worker(c, line);
+    setpgid(pid, pid);
+    c->worker = pid;
+    close_received(c);
+    return 0;
+}
+
+static int read_request(conn_t *c) {
+    while (c->len < sizeof(c->buf)) {
+        char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+        struct iovec iov = { c->buf + c->len, sizeof(c->buf) - c->len };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        ssize_t r = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (r < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        if (r == 0) return -1;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+            int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *fds = (int *)CMSG_DATA(cm);
+            for (int i = 0; i < n; i++) {
+                if (c->nfds < 3) c->fds[c->nfds++] = fds[i];
+                else close(fds[i]);
+            }
+        }
+        c->len += r;
+        if (c->worker == 0 && start_request(c) < 0) return -1;
+        if (c->worker) return 0;
+    }
+    return -1;  // request larger than any line the shell accepts
+}
+
+static long long tv_us(const struct timeval *tv) {
+    return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+static void reap_workers(void) {
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+        for (int i = 0; i < nconns; i++) {
+            conn_t *c = conns[i];
+            if (c->worker != pid) continue;
+            c->worker = 0;
+            if (c->hangup) { drop_conn(i); break; }
+
+            // Linux reports the worker's usage together with every child
+            // it waited for, which covers all stages of the pipeline.
+            tsh_reply_t reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.status = status_to_exit(status);
+            reply.wall_us = trace_now_us() - c->start_us;
+            reply.user_us = tv_us(&ru.ru_utime);
+            reply.sys_us = tv_us(&ru.ru_stime);
+            reply.maxrss_kb = ru.ru_maxrss;
+            if (send(c->fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply) || start_request(c) < 0)
+                drop_conn(i);
+            break;
+        }
+    }
+}
+
+// tsh --serve PATH: run command lines sent over a Unix socket, each in a
+// forked worker, until SIGINT or SIGTERM.
+int serve(const char *path) {
+    listen_fd = listen_on(path);
+    if (listen_fd < 0) return -1;
+    if (pipe(wake_pipe) < 0) { perror("tsh: pipe"); close(listen_fd); return -1; }
+    set_nonblock_cloexec(wake_pipe[0]);
+    set_nonblock_cloexec(wake_pipe[1]);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = serve_sigchld;
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_handler = serve_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd *pfds = NULL;
+    int pfd_cap = 0;
+    while (!stop_requested) {
+        if (nconns + 2 > pfd_cap) {
+            pfd_cap = (nconns + 2) * 2;
+            struct pollfd *grown = realloc(pfds, sizeof(*pfds) * pfd_cap);
+            if (!grown) { perror("tsh: realloc"); break; }
+            pfds = grown;
+        }
+        pfds[0] = (struct pollfd){ wake_pipe[0], POLLIN, 0 };
+        pfds[1] = (struct pollfd){ listen_fd, POLLIN, 0 };
+        // Connections with a request in flight are only watched for hangup,
+        // and not at all once the client is known to be gone.
+        for (int i = 0; i < nconns; i++) {
+            conn_t *c = conns[i];
+            pfds[i + 2] = (struct pollfd){ c->hangup ? -1 : c->fd, c->worker ? 0 : POLLIN, 0 };
+        }
+        int npfds = nconns + 2;
+
+        if (poll(pfds, npfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("tsh: poll");
+            break;
+        }
+
+        // Walk backwards: drop_conn moves the last connection into the hole.
+        for (int i = npfds - 1; i >= 2; i--) {
+            conn_t *c = conns[i - 2];
+            if (!pfds[i].revents) continue;
+            if (c->worker) {
+                if (pfds[i].revents & (POLLHUP | POLLERR)) {
+                    kill(-c->worker, SIGHUP);
+                    c->hangup = 1;
+                }
+            } else if (read_request(c) < 0) {
+                drop_conn(i - 2);
+            }
+        }
+        if (pfds[1].revents & POLLIN) accept_clients();
+        if (pfds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+            reap_workers();
+        }
+    }
+
+    for (int i = 0; i < nconns; i++)
+        if (conns[i]->worker) kill(-conns[i]->worker, SIGHUP);
+    while (nconns > 0) drop_conn(nconns - 1);
+    free(conns);
+    free(pfds);
+    close(listen_fd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "trace.h"
+
+// Records are Chrome trace-event objects ("ph":"X"), one per line, inside
+// an unterminated JSON array; chrome://tracing and Perfetto load that
+// as-is, and line-oriented tools can strip the trailing comma.
+#define TRACE_BUF_SIZE (64 * 1024)
+#define TRACE_FLUSH_AT (TRACE_BUF_SIZE - 4096)
+
+static int trace_fd = -1;
+static char tbuf[TRACE_BUF_SIZE];
+static size_t tlen = 0;
+static unsigned long dropped = 0;
+static pid_t shell_pid;
+
+int trace_open(const char *path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0644);
+    if (trace_fd < 0) return -1;
+    shell_pid = getpid();
+    memcpy(tbuf, "[\n", 2);
+    tlen = 2;
+    return 0;
+}
+
+int trace_enabled(void) {
+    return trace_fd >= 0;
+}
+
+long long trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// A slow reader (e.g. a FIFO) never stalls the shell: whatever cannot be
+// written right away stays in the buffer for the next flush, and records
+// that no longer fit are dropped whole (see trace_pipeline), so the file
+// never holds a torn record.
+void trace_flush(void) {
+    if (trace_fd < 0 || tlen == 0) return;
+    size_t off = 0;
+    while (off < tlen) {
+        ssize_t n = write(trace_fd, tbuf + off, tlen - off);
+        if (n > 0) { off += n; continue; }
+        if (n < 0 && errno == EINTR) continue;
+        break;
+    }
+    memmove(tbuf, tbuf + off, tlen - off);
+    tlen -= off;
+}
+
+// Forked children share the file but not the buffer; only the shell that
+// opened the trace writes to it.
+void trace_forget(void) {
+    trace_fd = -1;
+    tlen = 0;
+}
+
+// Writes out everything, waiting for the reader if need be. For when the
+// shell is about to exit or exec and would otherwise cut a record short.
+void trace_sync(void) {
+    if (trace_fd < 0) return;
+    int flags = fcntl(trace_fd, F_GETFL);
+    fcntl(trace_fd, F_SETFL, flags & ~O_NONBLOCK);
+    trace_flush();
+    fcntl(trace_fd, F_SETFL, flags);
+}
+
+void trace_close(void) {
+    if (trace_fd < 0) return;
+    trace_sync();
+    if (dropped) fprintf(stderr, "tsh: trace: %lu record(s) dropped\n", dropped);
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+typedef struct sbuf {
+    char *s;
+    size_t len, cap;
+} sbuf_t;
+
+static void sb_grow(sbuf_t *b, size_t need) {
+    if (b->len + need + 1 <= b->cap) return;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + need + 1) cap *= 2;
+    char *s = realloc(b->s, cap);
+    if (!s) return;
+    b->s = s;
+    b->cap = cap;
+}
+
+static void sb_puts(sbuf_t *b, const char *s) {
+    size_t n = strlen(s);
+    sb_grow(b, n);
+    if (b->len + n + 1 > b->cap) return;
+    memcpy(b->s + b->len, s, n + 1);
+    b->len += n;
+}
+
+static void sb_json_escape(sbuf_t *b, const char *s) {
+    for (; *s; s++) {
+        char esc[8];
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') { esc[0] = '\\'; esc[1] = c; esc[2] = '\0'; }
+        else if (c < 0x20) snprintf(esc, sizeof(esc), "\\u%04x", c);
+        else { esc[0] = c; esc[1] = '\0'; }
+        sb_puts(b, esc);
+    }
+}
+
+static void sb_json_str(sbuf_t *b, const char *s) {
+    sb_puts(b, "\"");
+    sb_json_escape(b, s);
+    sb_puts(b, "\"");
+}
+
+// Builds the launch-time half of a record (name, line, argv, pids); the
+// caller keeps it until the pipeline has been reaped.
+char *trace_describe(command_t cmds[], int ncmds, const char *line, const pid_t *pids, int npids) {
+    sbuf_t b = { NULL, 0, 0 };
+    char num[32];
+
+    sb_puts(&b, "\"name\":\"");
+    for (int i = 0; i < ncmds; i++) {
+        if (i) sb_puts(&b, " | ");
+        sb_json_escape(&b, cmds[i].argv[0] ? cmds[i].argv[0] : "");
+    }
+    sb_puts(&b, "\",\"args\":{\"line\":");
+    sb_json_str(&b, line);
+    sb_puts(&b, ",\"argv\":[");
+    for (int i = 0; i < ncmds; i++) {
+        sb_puts(&b, i ? ",[" : "[");
+        for (int j = 0; cmds[i].argv[j]; j++) {
+            if (j) sb_puts(&b, ",");
+            sb_json_str(&b, cmds[i].argv[j]);
+        }
+        sb_puts(&b, "]");
+    }
+    sb_puts(&b, "],\"pids\":[");
+    for (int i = 0; i < npids; i++) {
+        snprintf(num, sizeof(num), i ? ",%d" : "%d", (int)pids[i]);
+        sb_puts(&b, num);
+    }
+    sb_puts(&b, "]");
+    return b.s;
+}
+
+static int format_record(char *dst, size_t room, const char *desc, pid_t pgid, int jid, long long start_us,
+                         long long spawn_us, long long end_us, long long cpu_us, int status) {
+    return snprintf(dst, room,
+                    "{\"ph\":\"X\",\"cat\":\"pipeline\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,%s,"
+                    "\"spawn_us\":%lld,\"cpu_us\":%lld,\"status\":%d,\"jid\":%d}},\n",
+                    start_us, end_us - start_us, (int)shell_pid, (int)(pgid ? pgid : shell_pid), desc,
+                    spawn_us, cpu_us, status, jid);
+}
+
+// Costs one snprintf into the in-memory buffer; the file only sees a
+// write() every TRACE_FLUSH_AT bytes.
+void trace_pipeline(const char *desc, pid_t pgid, int jid, long long start_us, long long spawn_us,
+                    long long end_us, long long cpu_us, int status) {
+    if (trace_fd < 0 || !desc) return;
+    if (tlen >= TRACE_FLUSH_AT) trace_flush();
+
+    size_t room = sizeof(tbuf) - tlen;
+    int n = format_record(tbuf + tlen, room, desc, pgid, jid, start_us, spawn_us, end_us, cpu_us, status);
+    if (n < 0) return;
+    if ((size_t)n >= room) {
+        // Too big for what is left: flush and retry once, else drop it.
+        trace_flush();
+        room = sizeof(tbuf) - tlen;
+        n = format_record(tbuf + tlen, room, desc, pgid, jid, start_us, spawn_us, end_us, cpu_us, status);
+        if (n < 0 || (size_t)n >= room) { dropped++; return; }
+    }
+    tlen += n;
+}
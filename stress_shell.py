@@ -0,0 +1,239 @@
+"""Stress harness for tsh job control.
+
+Drives a shell through stdin in phases and checks, after each phase, that
+every background job was reaped (no lost SIGCHLD: `wait` must return), that
+no zombie children are left behind, and that the job table is empty again:
+
+  churn      short background pipelines, `wave` launched before each wait
+  burst      `burst` jobs alive and in the job table at the same time,
+             then all killed at once
+  stop/cont  kill -TSTP / bg / fg cycles on background jobs
+  tty        a foreground pipeline on a pty stopped with a real Ctrl-Z and
+             resumed with fg, `tty` times
+
+Any "cannot add job" from the shell fails the run: a job missing from the
+table is one `wait` would not wait for.
+
+When tsh-asan exists (make asan) the same phases are replayed against it at
+a smaller scale and any AddressSanitizer/LeakSanitizer report fails the run.
+
+    python3 stress_shell.py [--pipelines 3000] [--wave 1000] [--burst 2000]
+                            [--cycles 200] [--tty 20]
+"""
+import argparse
+import os
+import pty
+import select
+import signal
+import subprocess
+import sys
+import time
+
+
+def children_of(pid):
+    """Returns (pid, state) for every live child of pid, from /proc."""
+    kids = []
+    for entry in os.listdir("/proc"):
+        if not entry.isdigit():
+            continue
+        try:
+            with open(f"/proc/{entry}/stat") as f:
+                stat = f.read()
+        except OSError:
+            continue
+        fields = stat.rsplit(")", 1)[1].split()
+        if int(fields[1]) == pid:
+            kids.append((int(entry), fields[0]))
+    return kids
+
+
+class Shell:
+    def __init__(self, path):
+        self.proc = subprocess.Popen([path], stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                     stderr=subprocess.PIPE, text=True, bufsize=1)
+        self.marker = 0
+        self.pending = b""
+
+    def send(self, lines):
+        self.proc.stdin.write("".join(line + "\n" for line in lines))
+        self.proc.stdin.flush()
+
+    def sync(self, timeout):
+        """Runs an echo after everything sent so far and waits for it."""
+        self.marker += 1
+        tag = f"__sync_{self.marker}__"
+        self.send([f"echo {tag}"])
+        out = []
+        deadline = time.time() + timeout
+        fd = self.proc.stdout.fileno()
+        while True:
+            # Raw reads: select() cannot see data already sitting in a
+            # Python-side buffer.
+            while b"\n" in self.pending:
+                line, self.pending = self.pending.split(b"\n", 1)
+                line = line.decode(errors="replace")
+                if line.strip() == tag:
+                    return out
+                out.append(line)
+            left = deadline - time.time()
+            if left <= 0 or not select.select([fd], [], [], left)[0]:
+                raise AssertionError(f"shell did not reach {tag} in {timeout}s (lost SIGCHLD or hung wait?)")
+            chunk = os.read(fd, 65536)
+            if not chunk:
+                raise AssertionError("shell exited early")
+            self.pending += chunk
+
+    def check_clean(self, phase):
+        self.send(["wait"])
+        self.sync(30)
+        # The sync echo itself may not have been reaped yet when its output
+        # arrives, so allow a short grace period before calling it a leak.
+        deadline = time.time() + 1
+        kids = children_of(self.proc.pid)
+        while kids and time.time() < deadline:
+            time.sleep(0.01)
+            kids = children_of(self.proc.pid)
+        if kids:
+            raise AssertionError(f"{phase}: children left behind: {kids[:10]}")
+        self.send(["jobs"])
+        leftover = [l for l in self.sync(10) if "Running" in l or "Stopped" in l]
+        if leftover:
+            raise AssertionError(f"{phase}: jobs still listed: {leftover[:5]}")
+
+    def close(self):
+        self.proc.stdin.close()
+        err = self.proc.stderr.read()
+        self.proc.wait(timeout=30)
+        return err
+
+
+def phase_churn(sh, pipelines, wave):
+    """Thousands of short background pipelines, `wave` in flight at a time."""
+    launched = 0
+    while launched < pipelines:
+        n = min(wave, pipelines - launched)
+        sh.send(["true | cat | true &"] * n + ["wait"])
+        launched += n
+        sh.sync(60)
+    sh.check_clean("churn")
+
+
+def phase_burst(sh, jobs):
+    """`jobs` live background jobs at once, killed together so their SIGCHLDs arrive in a storm."""
+    sh.send(["sleep 60 &"] * jobs)
+    sh.sync(120)
+    kids = [pid for pid, state in children_of(sh.proc.pid) if state != "Z"]
+    if len(kids) < jobs:
+        raise AssertionError(f"burst: only {len(kids)} of {jobs} jobs alive at once")
+    sh.send(["jobs"])
+    listed = sum(1 for line in sh.sync(30) if "Running" in line)
+    if listed != jobs:
+        raise AssertionError(f"burst: {listed} of {jobs} live jobs in the job table")
+    for pid in kids:
+        os.kill(pid, signal.SIGKILL)
+    sh.check_clean("burst")
+
+
+def phase_stop_cont(sh, cycles):
+    """Ctrl-Z / bg / fg cycles against live jobs."""
+    for _ in range(cycles):
+        sh.send([
+            "sleep 0.02 &",
+            "kill -TSTP $!",
+            "bg %1",
+            "kill -TSTP $!",
+            "fg %1",
+            "wait",
+        ])
+    sh.sync(120)
+    sh.check_clean("stop/cont")
+
+
+def phase_tty(path, stops):
+    """Ctrl-Z on a foreground pipeline through a pty, then fg, `stops` times."""
+    pid, fd = pty.fork()
+    if pid == 0:
+        os.execv(path, [path])
+    buf = b""
+
+    def expect(needle, timeout=10):
+        nonlocal buf
+        deadline = time.time() + timeout
+        while needle.encode() not in buf:
+            left = deadline - time.time()
+            if left <= 0 or not select.select([fd], [], [], left)[0]:
+                raise AssertionError(f"tty: timed out waiting for {needle!r}; got {buf[-300:]!r}")
+            buf += os.read(fd, 65536)
+        before, _, buf = buf.partition(needle.encode())
+        return before.decode(errors="replace")
+
+    try:
+        expect("$ ")
+        # Every tick after a resume shows the job has the terminal back; the
+        # quotes keep the echoed command line from matching.
+        os.write(fd, b"sh -c 'while :; do echo ti\"\"ck; sleep 0.01; done' | cat\r")
+        expect("tick")
+        for _ in range(stops):
+            os.write(fd, b"\x1a")
+            expect("Stopped")
+            # Give the other stage's stop time to be (wrongly) announced too.
+            seen = expect("$ ")
+            time.sleep(0.05)
+            os.write(fd, b"fg %1\r")
+            if "Stopped" in seen + expect("tick"):
+                raise AssertionError("tty: one Ctrl-Z reported as stopped twice")
+        os.write(fd, b"\x03")
+        expect("$ ")
+        os.write(fd, b"jobs; echo __tty_done__\r")
+        leftover = expect("__tty_done__\r\n")
+        if "Running" in leftover or "Stopped" in leftover:
+            raise AssertionError(f"tty: jobs still listed: {leftover[-300:]!r}")
+        deadline = time.time() + 1
+        while children_of(pid) and time.time() < deadline:
+            time.sleep(0.01)
+        if children_of(pid):
+            raise AssertionError(f"tty: children left behind: {children_of(pid)[:10]}")
+    finally:
+        os.kill(pid, signal.SIGKILL)
+        os.waitpid(pid, 0)
+        os.close(fd)
+
+
+def run(path, pipelines, wave, burst, cycles, stops):
+    start = time.time()
+    sh = Shell(path)
+    try:
+        phase_churn(sh, pipelines, wave)
+        phase_burst(sh, burst)
+        phase_stop_cont(sh, cycles)
+    finally:
+        err = sh.close()
+    for bad in ("AddressSanitizer", "LeakSanitizer", "runtime error", "cannot add job"):
+        if bad in err:
+            raise AssertionError(f"{path}: {bad}:\n{err[-2000:]}")
+    if sh.proc.returncode != 0:
+        raise AssertionError(f"{path}: exit status {sh.proc.returncode}\n{err[-2000:]}")
+    phase_tty(path, stops)
+    print(f"{path}: {pipelines} pipelines, {burst} jobs at once, {cycles} stop/cont cycles, "
+          f"{stops} Ctrl-Z stops ok in {time.time() - start:.1f}s")
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--pipelines", type=int, default=3000)
+    ap.add_argument("--wave", type=int, default=1000)
+    ap.add_argument("--burst", type=int, default=2000)
+    ap.add_argument("--cycles", type=int, default=200)
+    ap.add_argument("--tty", type=int, default=20)
+    args = ap.parse_args()
+
+    if not os.path.exists("./tsh"):
+        sys.exit("tsh binary not found. Please compile first.")
+    run("./tsh", args.pipelines, args.wave, args.burst, args.cycles, args.tty)
+    if os.path.exists("./tsh-asan"):
+        run("./tsh-asan", max(args.pipelines // 10, args.wave // 10), args.wave // 10,
+            max(args.burst // 10, 200), max(args.cycles // 10, 1), max(args.tty // 10, 1))
+
+
+if __name__ == "__main__":
+    main()
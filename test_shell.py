@@ -2,6 +2,40 @@ import unittest
 import subprocess
 import os
 import time
+import json
+import pty
+import select
+import signal
+
+class PtyShell:
+    """Runs tsh on a pseudo-terminal, so job control is active."""
+    def __init__(self):
+        self.pid, self.fd = pty.fork()
+        if self.pid == 0:
+            os.execv('./tsh', ['./tsh'])
+        self.buf = b""
+
+    def send(self, text):
+        os.write(self.fd, text.encode())
+
+    def expect(self, needle, timeout=5):
+        deadline = time.time() + timeout
+        while needle.encode() not in self.buf:
+            left = deadline - time.time()
+            if left <= 0 or not select.select([self.fd], [], [], left)[0]:
+                raise AssertionError(f"timed out waiting for {needle!r}; got {self.buf[-300:]!r}")
+            try:
+                self.buf += os.read(self.fd, 4096)
+            except OSError:
+                raise AssertionError(f"tty closed waiting for {needle!r}")
+        before, _, self.buf = self.buf.partition(needle.encode())
+        return before.decode(errors="replace")
+
+    def close(self):
+        os.kill(self.pid, signal.SIGKILL)
+        os.waitpid(self.pid, 0)
+        os.close(self.fd)
+
 
 class TestTSH(unittest.TestCase):
     def run_shell(self, input_str):
@@ -89,6 +123,329 @@ class TestTSH(unittest.TestCase):
         # Just check if "2" or "1" is in output
         self.assertTrue(any(x in output for x in ["1", "2", "127"]))
 
+    def test_wait_job_status(self):
+        output = self.run_shell("sh -c 'sleep 0.2; exit 7' &\nwait %1\necho got=$?\n")
+        if output is None: return
+        self.assertIn("got=7", output)
+
+    def test_fg_bg_finished_job(self):
+        # A job that already exited gets no SIGCHLD; fg and bg must not wait for one.
+        output = self.run_shell("sh -c 'exit 4' &\nsleep 0.3\nfg %1\necho fg=$?\n"
+                                "sh -c 'exit 5' &\nsleep 0.3\nbg %1\necho bg=$?\nwait\necho waited\n")
+        if output is None: return
+        self.assertIn("fg=4", output)
+        self.assertIn("bg=5", output)
+        self.assertIn("waited", output)
+
+    def test_wait_stopped_job_status(self):
+        # 128 + the signal that stopped it, not always SIGTSTP.
+        output = self.run_shell("sleep 5 &\nkill -STOP $!\nsleep 0.2\nwait %1\necho got=$?\nkill -9 $!\n")
+        if output is None: return
+        self.assertIn("got=%d" % (128 + signal.SIGSTOP), output)
+
+    def test_wait_n_returns_first_finisher(self):
+        output = self.run_shell("sh -c 'exit 4' &\nsleep 2 &\nwait -n\necho first=$?\nkill $!\n")
+        if output is None: return
+        self.assertIn("first=4", output)
+
+    def test_wait_n_order_and_jobs(self):
+        # Both are done by the time wait -n runs; the one that finished first wins.
+        output = self.run_shell("sh -c 'sleep 0.4; exit 1' &\nsh -c 'exit 2' &\nsleep 0.8\n"
+                                "wait -n\necho first=$?\nwait\n"
+                                "sleep 1 &\nsh -c 'sleep 0.2; exit 6' &\nsh -c 'exit 7' &\n"
+                                "wait -n %1 %2\necho named=$?\nwait\n")
+        if output is None: return
+        self.assertIn("first=2", output)
+        self.assertIn("named=6", output)
+
+    def test_coproc(self):
+        output = self.run_shell("coproc cat\necho hello >&${COPROC[1]}\nhead -c 6 <&${COPROC[0]} | tr a-z A-Z\n"
+                                "env | grep COPROC || echo not-exported\n")
+        if output is None: return
+        self.assertIn("HELLO", output)
+        self.assertIn("not-exported", output)
+
+    def test_redirect_dup(self):
+        output = self.run_shell("ls /nonexistent 2>&1 | tr a-z A-Z\n")
+        if output is None: return
+        self.assertIn("NONEXISTENT", output)
+
+    def test_ulimit(self):
+        output = self.run_shell("ulimit -n 64 sh -c 'ulimit -n'\nulimit -n 100\nsh -c 'ulimit -n'\n")
+        if output is None: return
+        self.assertEqual(output.split(), ["64", "100"])
+
+    def test_stage_prefixes(self):
+        output = self.run_shell("cpuset 0 grep Cpus_allowed_list /proc/self/status | nice -n 3 cat\n"
+                                "nice -n5 sh -c 'echo n=$(nice)'\nnice --adjustment=3 sh -c 'echo a=$(nice)'\n"
+                                "nice\nulimit -f 18014398509481985 sh -c 'ulimit -f' || echo overflow\n")
+        if output is None: return
+        self.assertIn("Cpus_allowed_list:\t0", output)
+        self.assertIn("n=5", output)
+        self.assertIn("a=3", output)
+        self.assertIn("0\n", output)
+        self.assertIn("overflow", output)
+
+    def test_xtrace(self):
+        p = subprocess.run(['./tsh'], input="set -x\necho 'a b' c\nset +x\necho quiet\n",
+                           capture_output=True, text=True, timeout=5)
+        self.assertIn("+ echo 'a b' c", p.stderr)
+        self.assertNotIn("+ echo quiet", p.stderr)
+
+    def test_trace_file(self):
+        path = "trace_test.json"
+        try:
+            subprocess.run(['./tsh', '--trace', path],
+                           input="echo x | cat\nsh -c 'exit 3' &\nwait\nf() { exit 3; }\nf | cat\n",
+                           capture_output=True, text=True, timeout=5)
+            with open(path) as f:
+                events = json.loads(f.read().rstrip().rstrip(',') + ']')
+            # A subshell that exits must not write the shell's records again.
+            self.assertEqual(len([e for e in events if e["name"] == "echo | cat"]), 1)
+            pipe = [e for e in events if e["name"] == "echo | cat"][0]
+            self.assertEqual(pipe["args"]["argv"], [["echo", "x"], ["cat"]])
+            self.assertEqual(len(pipe["args"]["pids"]), 2)
+            bg = [e for e in events if e["name"] == "sh"][0]
+            self.assertEqual(bg["args"]["status"], 3)
+            self.assertEqual(bg["args"]["jid"], 1)
+        finally:
+            if os.path.exists(path): os.remove(path)
+
+    def test_tty_foreground_job_owns_terminal(self):
+        sh = PtyShell()
+        try:
+            sh.expect("$ ")
+            sh.send("python3 -c 'import os; print(\"FG\", os.tcgetpgrp(0) == os.getpgrp())'\r")
+            sh.expect("FG True")
+        finally:
+            sh.close()
+
+    def test_tty_ctrl_c_goes_to_job(self):
+        sh = PtyShell()
+        try:
+            sh.expect("$ ")
+            sh.send("sleep 10\r")
+            time.sleep(0.5)
+            sh.send("\x03")
+            sh.expect("$ ")
+            sh.send("echo rc=$?\r")
+            sh.expect("rc=130")
+        finally:
+            sh.close()
+
+    def test_tty_ctrl_c_breaks_wait(self):
+        sh = PtyShell()
+        try:
+            sh.expect("$ ")
+            sh.send("sleep 10 &\r")
+            sh.expect("$ ")
+            sh.send("wait\r")
+            time.sleep(0.3)
+            sh.send("\x03")
+            sh.expect("$ ", timeout=3)
+            sh.send("echo rc=$?; jobs\r")
+            sh.expect("rc=130")
+            sh.expect("Running")
+            sh.send("kill %1\r")
+        finally:
+            sh.close()
+
+    def test_tty_continuation_interrupted(self):
+        # ^C and ^D at the "> " prompt drop the unfinished command, not the shell.
+        sh = PtyShell()
+        try:
+            sh.expect("$ ")
+            sh.send("echo 'open\r")
+            sh.expect("> ")
+            sh.send("\x03")
+            sh.expect("$ ")
+            sh.send("echo fresh $?\r")
+            sh.expect("\r\nfresh 130")
+            sh.send("echo 'again\r")
+            sh.expect("> ")
+            sh.send("\x04")
+            sh.expect("unexpected EOF")
+            sh.send("echo alive\r")
+            sh.expect("\r\nalive")
+        finally:
+            sh.close()
+
+    def test_tty_ctrl_z_then_fg(self):
+        sh = PtyShell()
+        try:
+            sh.expect("$ ")
+            sh.send("sleep 10\r")
+            time.sleep(0.5)
+            sh.send("\x1a")
+            sh.expect("Stopped")
+            sh.expect("$ ")
+            sh.send("fg %1\r")
+            time.sleep(0.5)
+            sh.send("\x03")
+            sh.expect("$ ")
+            sh.send("echo rc=$?\r")
+            sh.expect("rc=130")
+        finally:
+            sh.close()
+
+    def test_tty_ctrl_z_pipeline_reported_once(self):
+        sh = PtyShell()
+        try:
+            sh.expect("$ ")
+            sh.send("sleep 10 | sleep 10\r")
+            time.sleep(0.5)
+            sh.send("\x1a")
+            sh.expect("Stopped")
+            time.sleep(0.3)
+            sh.send("echo mark\r")
+            self.assertNotIn("Stopped", sh.expect("mark"))
+        finally:
+            sh.close()
+
+    def test_startup_profile_noninteractive(self):
+        # Piped stdin: no prompt or terminal setup should happen, and the first
+        # command must be reached quickly.
+        p = subprocess.run(['./tsh', '--startup-profile'], input="true\n",
+                           capture_output=True, text=True, timeout=5)
+        phases = {}
+        for line in p.stderr.splitlines():
+            parts = line.rsplit(None, 1)
+            if line.startswith("  ") and len(parts) == 2:
+                phases[parts[0].strip()] = parts[1]
+        self.assertEqual(phases.get("terminal"), "skipped")
+        self.assertEqual(phases.get("prompt"), "skipped")
+        self.assertNotIn("\033[", p.stdout)
+        self.assertLess(int(phases["first command"]), 50000)
+
+    def test_builtin_utilities(self):
+        output = self.run_shell("printf '%s-%03d|' a 7 b 8\necho\necho -e 'x\\ty'\n"
+                                "[ 3 -gt 2 -a -d / ]\necho t=$?\ntest abc = abd\necho f=$?\n"
+                                "echo out >/dev/null\necho restored\n"
+                                "true | exit 3\necho piped=$?\necho 'echo via-stdin' | source /dev/stdin\n")
+        self.assertIn("a-007|b-008|", output)
+        self.assertIn("x\ty", output)
+        self.assertIn("t=0", output)
+        self.assertIn("f=1", output)
+        self.assertIn("restored", output)
+        self.assertIn("piped=3", output)
+        self.assertIn("via-stdin", output)
+
+    def test_exec_and_source(self):
+        with open("test_lib.tsh", "w") as f:
+            f.write("# library\nexport LIBVAL=42\n/bin/echo loaded\n")
+        open("test_empty.tsh", "w").close()
+        try:
+            output = self.run_shell("source ./test_lib.tsh\necho lib=$LIBVAL\n"
+                                    "false\n. ./test_empty.tsh\necho empty=$?\nhistory\n"
+                                    "{ . ./test_lib.tsh; echo lib=$LIBVAL in-group; } | cat\n"
+                                    "exec 3>test_fd3.txt\necho via3 >&3\nexec 3>&-\n"
+                                    "cat test_fd3.txt\nexec sh -c 'echo replaced'\necho gone\n")
+        finally:
+            for f in ("test_lib.tsh", "test_empty.tsh", "test_fd3.txt"):
+                if os.path.exists(f): os.remove(f)
+        self.assertIn("lib=42", output)
+        self.assertIn("empty=0", output)
+        # The forked group must not exec the sourced file's last line in place.
+        self.assertIn("lib=42 in-group", output)
+        # Piped-in lines are not interactive input, so no history.
+        self.assertNotIn("source ./test_lib.tsh", output)
+        self.assertIn("via3", output)
+        self.assertIn("replaced", output)
+        self.assertNotIn("gone", output)
+
+    def test_functions(self):
+        output = self.run_shell("greet() {\n  local who=$1\n  shift\n  echo \"hi $who [$#] $@\"\n  return 3\n}\n"
+                                "who=outer\ngreet 'big world' a b\necho rc=$? who=$who\n"
+                                "count() { echo n=$#; }\ncount \"\"\n"
+                                "greet x | tr a-z A-Z\n"
+                                "down() { [ $# -gt 0 ] || return 0; echo -n \"$1 \"; shift; down \"$@\"; }\n"
+                                "down 3 2 1 && echo end\nunset -f down\ndown 2>/dev/null || echo unset\n")
+        self.assertIn("hi big world [2] a b", output)
+        self.assertIn("rc=3 who=outer", output)
+        self.assertIn("n=1", output)
+        self.assertIn("HI X [0]", output)
+        self.assertIn("3 2 1 end", output)
+        self.assertIn("unset", output.split("end", 1)[1])
+
+    def test_parameter_frames_exhausted(self):
+        # Recurse to the function limit, then fill the last frames with
+        # sourced files; the caller's $1 and locals must survive.
+        with open("test_deep.tsh", "w") as f:
+            f.write(". ./test_deep.tsh a\ntrue\n")
+        try:
+            output = self.run_shell("nest() { nest 2>/dev/null || . ./test_deep.tsh a; }\n"
+                                    "outer() { local v=kept; nest; echo \"after [$1] v=$v\"; }\n"
+                                    "v=top\nouter arg\necho top v=$v\n")
+        finally:
+            os.remove("test_deep.tsh")
+        self.assertIn("after [arg] v=kept", output)
+        self.assertIn("top v=top", output)
+
+    def test_aliases(self):
+        output = self.run_shell("alias up='tr a-z A-Z' say='echo said'\nsay hi | up\n"
+                                "alias say\nunalias say\nsay 2>/dev/null || echo gone\n")
+        self.assertIn("SAID HI", output)
+        self.assertIn("alias say='echo said'", output)
+        self.assertIn("gone", output)
+
+    def test_pipestatus_and_pipefail(self):
+        # The first stage exits last; $? must still be the last stage's.
+        output = self.run_shell("sh -c 'sleep 0.2; exit 1' | true\necho rc=$?\n"
+                                "sh -c 'exit 3' | sh -c 'exit 5' | true\n"
+                                "echo ps=${PIPESTATUS[0]},${PIPESTATUS[1]},${PIPESTATUS[2]}\n"
+                                "env | grep PIPESTATUS || echo not-exported\n"
+                                "set -o pipefail\nsh -c 'exit 3' | sh -c 'exit 5' | true\necho fail=$?\n")
+        self.assertIn("rc=0", output)
+        self.assertIn("ps=3,5,0", output)
+        self.assertIn("not-exported", output)
+        self.assertIn("fail=5", output)
+
+    def test_simple_command_syscalls(self):
+        # Syscalls made by the shell, and by its child up to execve, for a
+        # plain external command. Keeps the fast path from quietly growing.
+        def count(n):
+            p = subprocess.run(['./syscount', './tsh'], input="/bin/true\n" * n,
+                               capture_output=True, text=True, timeout=10)
+            return int(p.stderr.rsplit("syscount:", 1)[1])
+        per_command = (count(21) - count(1)) / 20
+        self.assertLessEqual(per_command, 12)
+
+    def test_serve(self):
+        sock = os.path.abspath("test_serve.sock")
+        server = subprocess.Popen(['./tsh', '--serve', sock])
+        try:
+            deadline = time.time() + 5
+            while not os.path.exists(sock) and time.time() < deadline:
+                time.sleep(0.02)
+
+            def client(cmd, **kw):
+                return subprocess.run(['./tshc', '-v', sock, cmd], capture_output=True,
+                                      text=True, timeout=5, **kw)
+
+            r = client("echo hi | tr h H")
+            self.assertEqual(r.stdout, "Hi\n")
+            self.assertEqual(r.returncode, 0)
+            self.assertIn("user_us=", r.stderr)
+            self.assertEqual(client("sh -c 'exit 5'").returncode, 5)
+            self.assertEqual(client("cat", input="piped\n").stdout, "piped\n")
+            # Each request gets its own copy of the shell's state.
+            client("cd /")
+            self.assertEqual(client("pwd").stdout.strip(), os.getcwd())
+            with open("test_serve_lib.tsh", "w") as f:
+                f.write("/bin/echo from-lib\n")
+            self.assertEqual(client(". ./test_serve_lib.tsh; echo after").stdout, "from-lib\nafter\n")
+
+            # Requests from different clients run side by side.
+            start = time.time()
+            clients = [subprocess.Popen(['./tshc', sock, 'sleep 0.5']) for _ in range(10)]
+            self.assertEqual([c.wait(timeout=5) for c in clients], [0] * 10)
+            self.assertLess(time.time() - start, 3)
+        finally:
+            server.terminate()
+            server.wait(timeout=5)
+            if os.path.exists("test_serve_lib.tsh"): os.remove("test_serve_lib.tsh")
+        self.assertFalse(os.path.exists(sock))
+
 if __name__ == '__main__':
     if not os.path.exists("./tsh") and not os.path.exists("./tsh.exe"):
         print("Warning: tsh binary not found. Please compile first.")
@@ -0,0 +1,105 @@
+// syscount: counts the system calls a shell makes to start its commands.
+//
+//   syscount COMMAND [ARGS...]
+//
+// Runs COMMAND under ptrace and counts every syscall it makes after its
+// own exec, plus those of each process it forks or vforks up to and
+// including that child's execve; after that the child is left alone.
+// The total goes to stderr as "syscount: N". Used by test_shell.py to keep
+// the path from reading a line to exec'ing the command from growing.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#define MAX_TRACED 256
+
+typedef struct traced {
+    pid_t pid;
+    int in_syscall;     // between the entry and exit stops
+    int counting;
+} traced_t;
+
+static traced_t traced[MAX_TRACED];
+static int ntraced = 0;
+
+static traced_t *lookup(pid_t pid, int counting) {
+    for (int i = 0; i < ntraced; i++) if (traced[i].pid == pid) return &traced[i];
+    if (ntraced == MAX_TRACED) return NULL;
+    traced_t *t = &traced[ntraced++];
+    t->pid = pid;
+    t->in_syscall = 0;
+    t->counting = counting;
+    return t;
+}
+
+static void forget(pid_t pid) {
+    for (int i = 0; i < ntraced; i++) if (traced[i].pid == pid) { traced[i] = traced[--ntraced]; return; }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: syscount COMMAND [ARGS...]\n");
+        return 2;
+    }
+
+    pid_t root = fork();
+    if (root < 0) { perror("syscount: fork"); return 2; }
+    if (root == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) { perror("syscount: ptrace"); _exit(126); }
+        raise(SIGSTOP);
+        execvp(argv[1], argv + 1);
+        fprintf(stderr, "syscount: %s: %s\n", argv[1], strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(root, &status, 0) < 0 || !WIFSTOPPED(status)) { fprintf(stderr, "syscount: cannot trace\n"); return 2; }
+    long opts = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, root, NULL, (void *)opts) < 0) { perror("syscount: ptrace"); return 2; }
+    lookup(root, 0);    // counting starts once COMMAND itself is running
+    ptrace(PTRACE_SYSCALL, root, NULL, NULL);
+
+    long count = 0;
+    int root_status = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, __WALL)) > 0) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            forget(pid);
+            if (pid == root) { root_status = status; break; }
+            continue;
+        }
+        if (!WIFSTOPPED(status)) continue;
+
+        // New children are traced from birth and count at once.
+        traced_t *t = lookup(pid, 1);
+        if (!t) { ptrace(PTRACE_DETACH, pid, NULL, NULL); continue; }
+        int sig = WSTOPSIG(status);
+        int event = status >> 16;
+        int inject = 0;
+
+        if (sig == (SIGTRAP | 0x80)) {
+            t->in_syscall = !t->in_syscall;
+            if (t->in_syscall && t->counting) count++;
+        } else if (event == PTRACE_EVENT_EXEC) {
+            if (pid == root) {
+                t->counting = 1;
+            } else {
+                ptrace(PTRACE_DETACH, pid, NULL, NULL);
+                forget(pid);
+                continue;
+            }
+        } else if (event == 0 && sig != SIGSTOP && sig != SIGTRAP) {
+            inject = sig;   // a real signal for the tracee
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)inject);
+    }
+
+    fprintf(stderr, "syscount: %ld\n", count);
+    if (WIFEXITED(root_status)) return WEXITSTATUS(root_status);
+    return 128 + WTERMSIG(root_status);
+}
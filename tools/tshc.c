@@ -0,0 +1,103 @@
+// tshc: minimal client for tsh --serve.
+//
+//   tshc [-v] SOCKET COMMAND...
+//
+// Sends COMMAND (words joined by spaces) with tshc's own stdin, stdout and
+// stderr, waits for it, and exits with its status. -v prints the usage
+// figures from the reply to stderr.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "tshc: socket path too long\n"); return -1; }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { perror("tshc: socket"); return -1; }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "tshc: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_request(int fd, const char *line) {
+    uint32_t n = strlen(line);
+    struct iovec iov[2] = { { &n, sizeof(n) }, { (void *)line, n } };
+
+    int stdio[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    union { char buf[CMSG_SPACE(sizeof(stdio))]; struct cmsghdr align; } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(stdio));
+    memcpy(CMSG_DATA(cm), stdio, sizeof(stdio));
+
+    ssize_t w = sendmsg(fd, &msg, 0);
+    if (w < 0) { perror("tshc: sendmsg"); return -1; }
+    // Anything the kernel did not take in one go goes out without fds.
+    size_t sent = w;
+    while (sent < sizeof(n) + n) {
+        size_t off = sent - sizeof(n);
+        w = write(fd, line + off, n - off);
+        if (w < 0) { if (errno == EINTR) continue; perror("tshc: write"); return -1; }
+        sent += w;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int verbose = 0;
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "-v") == 0) { verbose = 1; i++; }
+    if (argc - i < 2) {
+        fprintf(stderr, "usage: tshc [-v] SOCKET COMMAND...\n");
+        return 2;
+    }
+    const char *path = argv[i++];
+
+    char line[8192];
+    size_t len = 0;
+    for (; i < argc; i++) {
+        int w = snprintf(line + len, sizeof(line) - len, "%s%s", len ? " " : "", argv[i]);
+        if (w < 0 || (size_t)w >= sizeof(line) - len) { fprintf(stderr, "tshc: command too long\n"); return 2; }
+        len += w;
+    }
+
+    int fd = connect_to(path);
+    if (fd < 0 || send_request(fd, line) < 0) return 126;
+
+    tsh_reply_t reply;
+    size_t got = 0;
+    while (got < sizeof(reply)) {
+        ssize_t r = read(fd, (char *)&reply + got, sizeof(reply) - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) { fprintf(stderr, "tshc: connection closed before reply\n"); return 126; }
+        got += r;
+    }
+    close(fd);
+
+    if (verbose)
+        fprintf(stderr, "status=%d wall_us=%lld user_us=%lld sys_us=%lld maxrss_kb=%lld\n",
+                reply.status, (long long)reply.wall_us, (long long)reply.user_us,
+                (long long)reply.sys_us, (long long)reply.maxrss_kb);
+    return reply.status;
+}